@@ -19,25 +19,74 @@
  *
  */
 
+#if defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+# define HAVE_DECOMPRESS
+#endif
+/* fopencookie() is at hand with each C library for Linux, musl
+   included; the BSD ones provide funopen() instead.  */
+#if defined(__GLIBC__) || defined(__linux__)
+# define HAVE_FOPENCOOKIE
+#endif
+#define _GNU_SOURCE /* fopencookie(), O_DIRECT */
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _XOPEN_SOURCE 700
 #define _FILE_OFFSET_BITS 64
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <pwd.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <stdio.h>
+#ifdef __GLIBC__
+# include <stdio_ext.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+/* AVX2/AVX-512 variants are compiled with target attributes and chosen at run time.  */
+#if defined (__x86_64__) && (__GNUC__ >= 5 || defined (__clang__))
+# define HAVE_CPU_DISPATCH
+# include <immintrin.h>
+#endif
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+# include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+/* USDT probes, listed by `readelf -n' and usable with bpftrace, perf
+   and systemtap; a nop each when built in, nothing otherwise.  */
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define PROBE2(name, a1, a2)     STAP_PROBE2 (colorize, name, a1, a2)
+# define PROBE3(name, a1, a2, a3) STAP_PROBE3 (colorize, name, a1, a2, a3)
+#else
+# define PROBE2(name, a1, a2)     do { } while (false)
+# define PROBE3(name, a1, a2, a3) do { } while (false)
+#endif
 
 #ifndef DEBUG
 # define DEBUG 0
@@ -72,12 +121,28 @@
 # define BUF_SIZE 4096
 #endif
 
+#if defined(FLUSH_DEADLINE) && (FLUSH_DEADLINE <= 0 || FLUSH_DEADLINE > 10000)
+# undef FLUSH_DEADLINE
+#endif
+#ifndef FLUSH_DEADLINE
+# define FLUSH_DEADLINE 100 /* milliseconds */
+#endif
+
+#ifdef FUZZ
+# define CHUNK_SIZE fuzz_chunk_size ()
+#else
+# define CHUNK_SIZE BUF_SIZE
+#endif
+
 #define LF 0x01
 #define CR 0x02
 #define PARTIAL 0x04
 
 #define COUNT_OF(obj, type) (sizeof (obj) / sizeof (type))
 
+/* parameter required by the signature of a function pointer or macro */
+#define UNUSED(param) (void)(param)
+
 #define SKIP_LINE_ENDINGS(flags) ((flags) == (CR|LF) ? 2 : 1)
 
 #define VALID_FILE_TYPE(mode) (S_ISREG (mode) || S_ISLNK (mode) || S_ISFIFO (mode))
@@ -131,6 +196,20 @@
 
 #define MAX_ATTRIBUTE_CHARS (6 * 2)
 
+#define MAX_ESC_SEQUENCE_CHARS 4096
+
+#define MAX_FIELD_NUMBER 65535
+
+#define OUTPUT_BUF_SIZE (1024 * 1024)
+#define OUTPUT_ALIGN 4096
+#define OUTPUT_EXPANSION 4 /* colorizing: input size + 1/4 preallocated */
+
+#ifdef HAVE_DECOMPRESS
+# define MAX_MAGIC_CHARS 6
+# define DECOMPRESS_BUFS 4
+# define DECOMPRESS_BUF_SIZE 65536
+#endif
+
 #define PROGRAM_NAME "colorize"
 
 #define VERSION "0.66"
@@ -237,22 +316,68 @@ enum opt_set {
     OPT_EXCLUDE_RANDOM_SET = 0x02,
     OPT_OMIT_COLOR_EMPTY_SET = 0x04,
     OPT_RAINBOW_FG_SET = 0x08,
-    OPT_RAINBOW_BG_SET = 0x10
+    OPT_RAINBOW_BG_SET = 0x10,
+    OPT_FLUSH_SET = 0x20,
+    OPT_MINIMAL_ESCAPES_SET = 0x40,
+    OPT_DELIMITER_SET = 0x80,
+    OPT_HASH_KEY_SET = 0x100,
+    OPT_PASS_THROUGH_SET = 0x200,
+    OPT_DIRECT_SET = 0x400,
+    OPT_FSYNC_SET = 0x800,
+    OPT_PREALLOCATE_SET = 0x1000,
+    OPT_RAINBOW_SET = 0x2000,
+    OPT_HTML_SET = 0x4000,
+    OPT_TRACE_LATENCY_SET = 0x8000
 };
 static struct {
     char *attr;
+    char *clean_all;
+    char *delimiter;
     char *exclude_random;
-} opts_arg = { NULL, NULL };
+    char *field_colors;
+    char *flush;
+    char *hash_key;
+    char *in_place;
+    char *lines;
+    char *max_fps;
+    char *rainbow;
+    char *scanner;
+} opts_arg = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
 
 enum {
     OPT_ATTR = 1,
     OPT_CLEAN,
     OPT_CLEAN_ALL,
     OPT_CONFIG,
+    OPT_DELIMITER,
+    OPT_DIRECT,
     OPT_EXCLUDE_RANDOM,
+    OPT_EXEC,
+    OPT_FIELD_COLORS,
+    OPT_FLUSH,
+    OPT_FSYNC,
+    OPT_HASH_KEY,
+    OPT_HTML,
+    OPT_IN_PLACE,
+    OPT_LINES,
+    OPT_MAX_FPS,
+    OPT_MINIMAL_ESCAPES,
+    OPT_NORMALIZE,
     OPT_OMIT_COLOR_EMPTY,
+    OPT_OUTPUT,
+    OPT_PASS_THROUGH,
+    OPT_PREALLOCATE,
+    OPT_RAINBOW,
     OPT_RAINBOW_FG,
     OPT_RAINBOW_BG,
+    OPT_RECURSIVE,
+    OPT_SCANNER,
+    OPT_STDERR,
+    OPT_STDOUT,
+    OPT_TEE,
+    OPT_TIMESTAMP,
+    OPT_TIMESTAMP_COLOR,
+    OPT_TRACE_LATENCY,
     OPT_HELP,
     OPT_VERSION
 };
@@ -260,12 +385,37 @@ static int opt_type;
 static const struct option long_opts[] = {
     { "attr",             required_argument, &opt_type, OPT_ATTR             },
     { "clean",            no_argument,       &opt_type, OPT_CLEAN            },
-    { "clean-all",        no_argument,       &opt_type, OPT_CLEAN_ALL        },
+    { "clean-all",        optional_argument, &opt_type, OPT_CLEAN_ALL        },
     { "config",           required_argument, &opt_type, OPT_CONFIG           },
+    { "delimiter",        required_argument, &opt_type, OPT_DELIMITER        },
+    { "direct",           no_argument,       &opt_type, OPT_DIRECT           },
     { "exclude-random",   required_argument, &opt_type, OPT_EXCLUDE_RANDOM   },
+    { "exec",             required_argument, &opt_type, OPT_EXEC             },
+    { "field-colors",     required_argument, &opt_type, OPT_FIELD_COLORS     },
+    { "flush",            required_argument, &opt_type, OPT_FLUSH            },
+    { "fsync",            no_argument,       &opt_type, OPT_FSYNC            },
+    { "hash-key",         required_argument, &opt_type, OPT_HASH_KEY         },
+    { "html",             no_argument,       &opt_type, OPT_HTML             },
+    { "in-place",         optional_argument, &opt_type, OPT_IN_PLACE         },
+    { "lines",            required_argument, &opt_type, OPT_LINES            },
+    { "max-fps",          required_argument, &opt_type, OPT_MAX_FPS          },
+    { "minimal-escapes",  no_argument,       &opt_type, OPT_MINIMAL_ESCAPES  },
+    { "normalize",        no_argument,       &opt_type, OPT_NORMALIZE        },
     { "omit-color-empty", no_argument,       &opt_type, OPT_OMIT_COLOR_EMPTY },
+    { "output",           required_argument, &opt_type, OPT_OUTPUT           },
+    { "pass-through",     no_argument,       &opt_type, OPT_PASS_THROUGH     },
+    { "preallocate",      no_argument,       &opt_type, OPT_PREALLOCATE      },
+    { "rainbow",          required_argument, &opt_type, OPT_RAINBOW          },
     { "rainbow-fg",       no_argument,       &opt_type, OPT_RAINBOW_FG       },
     { "rainbow-bg",       no_argument,       &opt_type, OPT_RAINBOW_BG       },
+    { "recursive",        required_argument, &opt_type, OPT_RECURSIVE        },
+    { "scanner",          required_argument, &opt_type, OPT_SCANNER          },
+    { "stderr",           required_argument, &opt_type, OPT_STDERR           },
+    { "stdout",           required_argument, &opt_type, OPT_STDOUT           },
+    { "tee",              required_argument, &opt_type, OPT_TEE              },
+    { "timestamp",        optional_argument, &opt_type, OPT_TIMESTAMP        },
+    { "timestamp-color",  required_argument, &opt_type, OPT_TIMESTAMP_COLOR  },
+    { "trace-latency",    optional_argument, &opt_type, OPT_TRACE_LATENCY    },
     { "help",             no_argument,       &opt_type, OPT_HELP             },
     { "version",          no_argument,       &opt_type, OPT_VERSION          },
     {  NULL,              0,                 NULL,      0                    },
@@ -309,10 +459,512 @@ static struct {
 
 static bool clean;
 static bool clean_all;
+static bool field_colors;
+static bool minimal_escapes;
+static bool normalize;
 static bool omit_color_empty;
 static bool rainbow_fg;
 static bool rainbow_bg;
 
+/* --rainbow: unit colored by --rainbow-fg/--rainbow-bg  */
+enum rainbow_unit {
+    RAINBOW_LINE,
+    RAINBOW_CHAR,
+    RAINBOW_WORD
+};
+static enum rainbow_unit rainbow_unit = RAINBOW_LINE;
+static bool rainbow_space; /* last byte of previous part was whitespace */
+#define RAINBOW_SEQ_MAX 4096
+static char rainbow_held[RAINBOW_SEQ_MAX]; /* sequence split across buffers */
+static size_t rainbow_held_len;
+
+/* Sequences emitted for each line, set up by select_print_funcs() once
+   options have been processed (once per stream with --exec).  */
+static struct line_seqs {
+    /* print_line_color(), print_line_gather() */
+    char color_prefix[sizeof ("\033[49m\033[") + MAX_ATTRIBUTE_CHARS + sizeof ("39m")];
+    size_t color_prefix_len;
+    /* --rainbow=char|word: sequence per color, in rainbow order */
+    struct {
+        char seq[sizeof ("\033[") + MAX_ATTRIBUTE_CHARS + sizeof ("39m")];
+        unsigned int len;
+    } rainbow_seqs[16];
+    unsigned int rainbow_seqs_count;
+    unsigned int rainbow_pos;
+    char rainbow_prefix[sizeof ("\033[") + MAX_ATTRIBUTE_CHARS + sizeof ("39m")];
+} line_seqs_default;
+static struct line_seqs *line_seqs = &line_seqs_default;
+
+enum flush_mode {
+    FLUSH_LINE,
+    FLUSH_AUTO,
+    FLUSH_FULL
+};
+static enum flush_mode flush_mode = FLUSH_AUTO;
+
+static bool raw_input;
+static bool char_pushed_back;
+
+/* Color sequence of a line spanning several buffers has been
+   emitted, but not reset yet.  */
+static bool color_open;
+
+/* --field-colors: escape sequence per field number, [0] applies to
+   fields not listed (*)  */
+struct field_seq {
+    char seq[sizeof ("\033[1;39m")];
+    bool set;
+};
+static struct field_seq *field_seqs;
+static unsigned int field_max;
+
+static char field_delimiter = '\t';
+static bool field_delimiter_run; /* SPACE: runs of spaces separate once */
+
+static struct {
+    unsigned int index;
+    bool started; /* text of current field printed */
+} field_state = { 1, false };
+
+/* --hash-key: lines are colored by hashing a field or regex match
+   into a palette of the plain foreground colors  */
+static bool hash_key;
+static unsigned int hash_field; /* 0 for regex */
+static regex_t hash_regex;
+static bool hash_regex_compiled;
+static const struct color *hash_palette[8];
+static unsigned int hash_palette_count;
+static const struct color *hash_fallback; /* lines without key */
+
+/* --lines: range of lines (counted by LF) to be processed  */
+static bool lines_range;
+static unsigned long lines_start = 1;
+static unsigned long lines_end = ULONG_MAX;
+static unsigned long line_number = 1;
+static bool pass_through; /* print lines outside of range untouched */
+
+/* -o, --output: written through a large aligned stdout buffer  */
+static char *output_file;
+static bool output_direct;
+static bool output_fsync;
+static bool output_preallocate;
+static bool output_preallocated;
+
+/* --in-place: files are mapped read-only and cleaned a chunk at a time,
+   written back and truncated, or written to a file renamed over them */
+#ifndef IN_PLACE_CHUNK_SIZE
+# define IN_PLACE_CHUNK_SIZE (1024 * 1024)
+#endif
+#define RENAME_SUFFIX ".XXXXXX" /* mkstemp() */
+static enum {
+    IN_PLACE_NONE,
+    IN_PLACE_TRUNCATE,
+    IN_PLACE_RENAME
+} in_place;
+
+/* --recursive: the tree is walked and cleaned by a pool of threads.
+   Each owns a deque of tasks (directories, files, chunks of large
+   files), working it from the back while idle threads steal from the
+   front of others'.  Files are mapped read-only; chunks end at line
+   endings, so that each can be cleaned into a buffer of its own.  The
+   chunks done are written in order by whichever worker finds the next
+   one due, and the last one written joins them.  */
+#define WALK_WORKERS_MAX 64
+#ifndef WALK_CHUNK_SIZE
+# define WALK_CHUNK_SIZE (4 * 1024 * 1024)
+#endif
+static char *recursive_dir;
+enum walk_task_type {
+    TASK_DIR,
+    TASK_FILE,
+    TASK_CHUNK
+};
+struct walk_file {
+    char *path;
+    struct stat sb;
+    int fd;
+    char *map;
+    size_t chunks;
+    size_t *starts; /* chunks + 1 offsets */
+    char **texts;   /* cleaned, until written */
+    size_t *lens;
+    size_t next;    /* chunk to be written */
+    bool writing;
+    int out_fd;     /* fd unless mirrored or renamed */
+    char *out_path; /* -o: mirrored file; --in-place=rename: temporary file */
+    off_t written;
+    int error;      /* errno of a failed write */
+    pthread_mutex_t mutex;
+};
+struct walk_task {
+    enum walk_task_type type;
+    char *path;
+    struct walk_file *file;
+    size_t chunk;
+};
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long queued;
+    unsigned long pending; /* queued or running */
+    unsigned int count;
+    bool running; /* workers started */
+    bool failed;  /* entry not cleaned due to an error */
+    struct walk_deque {
+        pthread_mutex_t mutex;
+        struct walk_task *tasks;
+        size_t head, tail, size;
+    } deques[WALK_WORKERS_MAX];
+    struct {
+        dev_t dev;
+        ino_t ino;
+    } *links; /* cleaned in place, linked more than once */
+    size_t links_count, links_size;
+} walk;
+
+/* --tee: lines without escape sequences (as removed by --clean-all,
+   whatever the output mode) are written to a file as well.  A sequence
+   split across buffers is held back up to TEE_SEQ_MAX bytes.  */
+#define TEE_SEQ_MAX 4096
+static char *tee_file;
+static FILE *tee_stream;
+static char tee_pending[TEE_SEQ_MAX]; /* partial sequence of line spanning buffers */
+static size_t tee_pending_len;
+
+/* --timestamp: the formatted time is cached per second; fractions of
+   the second (%.S, %.T, %.s) are patched in per line.  The prefix has
+   a color of its own, faint unless --timestamp-color is given.  */
+#define TIMESTAMP_DEFAULT "%b %d %H:%M:%S"
+static bool timestamp;
+static char *timestamp_format;
+static char *timestamp_color;
+static char timestamp_seq[sizeof ("\033[1;39m")] = "\033[2m";
+static struct {
+    char *head; /* strftime() format up to fraction */
+    const char *tail;
+    bool fraction;
+    time_t sec;
+    char text[256];
+    size_t len;
+    size_t frac_pos;
+    struct timespec now; /* arrival of chunk */
+    bool line_start;
+} stamp = { NULL, NULL, false, (time_t)-1, "", 0, 0, { 0, 0 }, true };
+
+/* --exec: stdout and stderr of the command are read through pipes and
+   printed with colors of their own.  Lines are printed complete; once a
+   line too long for the buffer has been printed in part, its stream is
+   printed exclusively until the line ends.  The other stream is read on
+   meanwhile, lest the command block on a full pipe, and its text is held
+   back until then.  */
+static char *exec_command;
+static struct exec_stream {
+    char *color_string;
+    int fd;
+    char attr[MAX_ATTRIBUTE_CHARS + 1];
+    const struct color *colors[2];
+    struct line_seqs seqs;
+    char *(*print_lines) (const char *, const struct color **, const char *, char *, const char *, bool *);
+    void (*print_line_func) (const char *, const struct color **, const char * const, unsigned int, bool);
+    char buf[BUF_SIZE + 1];
+    size_t len;
+    bool mid_line; /* line printed in part */
+    char *held; /* read while the other stream is mid-line */
+    size_t held_len;
+    size_t held_size;
+    bool held_eof;
+} exec_streams[2]; /* stdout, stderr */
+static struct exec_stream *exec_current;
+
+/* --minimal-escapes: colors in effect since the last reset; the
+   background is turned off before line endings, so that terminals with
+   back-color erase do not fill the rest of the line (or scrolled-in
+   lines) with it.  */
+static const struct color *sgr_colors[2];
+static bool sgr_bg_erased;
+
+enum sgr_color_type {
+    SGR_COLOR_DEFAULT,
+    SGR_COLOR_BASIC,
+    SGR_COLOR_256,
+    SGR_COLOR_RGB
+};
+struct sgr_color {
+    enum sgr_color_type type;
+    unsigned int val[3];
+};
+struct sgr_state {
+    unsigned int attrs; /* bit n set for attribute n (1-9) */
+    struct sgr_color fg;
+    struct sgr_color bg;
+    bool unknown; /* parameters not modelled are in effect */
+};
+
+/* --normalize: state requested by the input and state emitted  */
+static struct sgr_state sgr_wanted, sgr_emitted;
+
+/* --html: standard output is replaced by a stream converting sequences
+   to spans, so that input sequences and colorize's own coloring are
+   rendered alike.  Memory is bounded by the buffers below.  */
+#define HTML_SEQ_MAX 64
+static bool html;
+static struct {
+    char out[65536];
+    size_t out_len;
+    char esc[HTML_SEQ_MAX]; /* sequence continued by the next write */
+    size_t esc_len;
+    struct sgr_state wanted, emitted;
+    bool span_open;
+} html_conv;
+enum { HC_TEXT, HC_LT, HC_GT, HC_AMP, HC_ESC };
+static unsigned char html_classes[256];
+
+/* Output is written to stdout, or, for --html, --trace-latency and
+   --max-fps, to a stream of its own which hands it to write_out().  */
+static FILE *out;
+
+/* --max-fps: output to a terminal is shown once per frame; frames with
+   more lines than the backlog show the newest screenful only.  */
+static unsigned int frame_rate;
+static unsigned long frame_backlog; /* lines, screen rows if 0 */
+static struct {
+    char *buf;
+    size_t len, size;
+    unsigned long lines; /* line endings in buf */
+    unsigned long skipped;
+    unsigned int rows;
+    bool mid_line; /* shown output ends without line ending */
+    long interval; /* nanoseconds */
+    struct timespec next;
+} frame;
+
+/* --trace-latency: chunks read are queued with the output offset they
+   end at and are taken off once writes have passed that offset.
+   Histograms are log-linear with a relative error of 1/TRACE_HIST_SUB.  */
+#define TRACE_HIST_SUB 16
+#define TRACE_QUEUE_MAX 1024
+#ifdef __GLIBC__
+# define PENDING_OUTPUT(s) __fpending (s)
+#else
+# define PENDING_OUTPUT(s) 0 /* buffered output is not accounted */
+#endif
+struct latency_hist {
+    unsigned long counts[64 * TRACE_HIST_SUB]; /* nanoseconds */
+    unsigned long count;
+    unsigned long max;
+    double sum;
+};
+static bool trace_latency;
+static char *trace_file;
+static FILE *trace_stream;
+static struct {
+    struct timespec chunk_read;
+    struct timespec last_write; /* completion of last write */
+    off_t written;  /* bytes of stdout written */
+    off_t produced; /* bytes of stdout produced by chunks */
+    struct {
+        off_t end;
+        struct timespec read;
+    } queue[TRACE_QUEUE_MAX];
+    unsigned int head, len;
+    struct latency_hist latency, write_wait;
+} trace;
+
+/* --clean-all: escape sequences are recognized by a DFA (ECMA-48)
+   which is driven by byte classes.  */
+enum esc_class {
+    EC_NUL, /* end of string */
+    EC_C0,  /* control characters */
+    EC_BEL,
+    EC_ESC,
+    EC_INT, /* intermediate bytes */
+    EC_DIG, /* 0-9 ; */
+    EC_COL, /* : */
+    EC_PRV, /* < = > ? */
+    EC_CSI, /* [ */
+    EC_OSC, /* ] */
+    EC_STR, /* P X ^ _ */
+    EC_ST,  /* \ */
+    EC_SGR, /* m */
+    EC_FIN, /* final bytes */
+    EC_DEL,
+    EC_HI,  /* 8-bit characters */
+    EC_COUNT
+};
+static const unsigned char esc_classes[256] = {
+    EC_NUL, EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_BEL, EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  /* 00-0f */
+    EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_C0,  EC_ESC, EC_C0,  EC_C0,  EC_C0,  EC_C0,  /* 10-1f */
+    EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, EC_INT, /* 20-2f */
+    EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_DIG, EC_COL, EC_DIG, EC_PRV, EC_PRV, EC_PRV, EC_PRV, /* 30-3f */
+    EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, /* 40-4f */
+    EC_STR, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_STR, EC_FIN, EC_FIN, EC_CSI, EC_ST,  EC_OSC, EC_STR, EC_STR, /* 50-5f */
+    EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_SGR, EC_FIN, EC_FIN, /* 60-6f */
+    EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_FIN, EC_DEL, /* 70-7f */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* 80-8f */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* 90-9f */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* a0-af */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* b0-bf */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* c0-cf */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* d0-df */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* e0-ef */
+    EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  EC_HI,  /* f0-ff */
+};
+
+enum esc_state {
+    ES_ESC,
+    ES_ESC_INT,
+    ES_CSI,
+    ES_CSI_PRV,
+    ES_CSI_INT,
+    ES_OSC,
+    ES_OSC_ESC,
+    ES_STR,
+    ES_STR_ESC,
+    ES_INCOMPLETE, /* final states */
+    ES_REJECT,
+    ES_SGR_END,
+    ES_CSI_END,
+    ES_OSC_END,
+    ES_DCS_END,
+    ES_ESC_END
+};
+#define ES_FINAL ES_INCOMPLETE
+
+enum esc_seq {
+    SEQ_SGR = 0x01,
+    SEQ_CSI = 0x02,
+    SEQ_OSC = 0x04,
+    SEQ_DCS = 0x08,
+    SEQ_ESC = 0x10,
+    SEQ_ALL = 0x1f
+};
+#define ES_SEQ(state) (1 << ((state) - ES_SGR_END))
+
+#define INC  ES_INCOMPLETE
+#define REJ  ES_REJECT
+#define ESCI ES_ESC_INT
+#define CSI  ES_CSI
+#define CSIP ES_CSI_PRV
+#define CSII ES_CSI_INT
+#define OSC  ES_OSC
+#define OSCE ES_OSC_ESC
+#define STR  ES_STR
+#define STRE ES_STR_ESC
+#define SGR_ ES_SGR_END
+#define CSI_ ES_CSI_END
+#define OSC_ ES_OSC_END
+#define DCS_ ES_DCS_END
+#define ESC_ ES_ESC_END
+static const unsigned char esc_transitions[ES_FINAL][EC_COUNT] = {
+      /* NUL   C0    BEL   ESC   INT   DIG   COL   PRV   CSI   OSC   STR   ST    SGR   FIN   DEL   HI */
+    { INC,  REJ,  REJ,  REJ,  ESCI, ESC_, ESC_, ESC_, CSI,  OSC,  STR,  ESC_, ESC_, ESC_, REJ,  REJ }, /* ES_ESC */
+    { INC,  REJ,  REJ,  REJ,  ESCI, ESC_, ESC_, ESC_, ESC_, ESC_, ESC_, ESC_, ESC_, ESC_, REJ,  REJ }, /* ES_ESC_INT */
+    { INC,  REJ,  REJ,  REJ,  CSII, CSI,  CSI,  CSIP, CSI_, CSI_, CSI_, CSI_, SGR_, CSI_, REJ,  REJ }, /* ES_CSI */
+    { INC,  REJ,  REJ,  REJ,  CSII, CSIP, CSIP, CSIP, CSI_, CSI_, CSI_, CSI_, CSI_, CSI_, REJ,  REJ }, /* ES_CSI_PRV */
+    { INC,  REJ,  REJ,  REJ,  CSII, REJ,  REJ,  REJ,  CSI_, CSI_, CSI_, CSI_, CSI_, CSI_, REJ,  REJ }, /* ES_CSI_INT */
+    { INC,  REJ,  OSC_, OSCE, OSC,  OSC,  OSC,  OSC,  OSC,  OSC,  OSC,  OSC,  OSC,  OSC,  OSC,  OSC }, /* ES_OSC */
+    { INC,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  OSC_, REJ,  REJ,  REJ,  REJ }, /* ES_OSC_ESC */
+    { INC,  REJ,  REJ,  STRE, STR,  STR,  STR,  STR,  STR,  STR,  STR,  STR,  STR,  STR,  STR,  STR }, /* ES_STR */
+    { INC,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  REJ,  DCS_, REJ,  REJ,  REJ,  REJ }, /* ES_STR_ESC */
+};
+#undef INC
+#undef REJ
+#undef ESCI
+#undef CSI
+#undef CSIP
+#undef CSII
+#undef OSC
+#undef OSCE
+#undef STR
+#undef STRE
+#undef SGR_
+#undef CSI_
+#undef OSC_
+#undef DCS_
+#undef ESC_
+
+static unsigned int clean_all_seqs = SEQ_ALL;
+
+#if defined (FUZZ) || defined (BENCH)
+static void print_clean (const char *);
+static bool is_esc (const char *);
+static const char *get_end_of_esc (const char *);
+#endif
+static void print_clean_fast (const char *);
+
+/* print_clean() is kept as reference implementation for fuzzing  */
+static void (*print_clean_func) (const char *) = print_clean_fast;
+
+#ifdef HAVE_DECOMPRESS
+enum compression {
+    COMPRESSION_GZIP,
+    COMPRESSION_XZ,
+    COMPRESSION_ZSTD
+};
+static const struct {
+    enum compression type;
+    const char *name;
+    const char *magic;
+    size_t magic_len;
+} compressions[] = {
+# ifdef HAVE_ZLIB
+    { COMPRESSION_GZIP, "gzip", "\x1f\x8b",                 2 },
+# endif
+# ifdef HAVE_LZMA
+    { COMPRESSION_XZ,   "xz",   "\xfd\x37\x7a\x58\x5a\x00", 6 },
+# endif
+# ifdef HAVE_ZSTD
+    { COMPRESSION_ZSTD, "zstd", "\x28\xb5\x2f\xfd",         4 },
+# endif
+};
+
+enum decompress_status {
+    DS_OK,
+    DS_END, /* end of gzip member, xz stream or zstd frame */
+    DS_ERROR
+};
+
+/* Compressed input is decompressed by a thread of its own into a ring
+   of buffers, which are drained by the stream's read function.  */
+struct decompress {
+    const char *file;
+    int fd;
+    enum compression type;
+    union {
+# ifdef HAVE_ZLIB
+        z_stream zs;
+# endif
+# ifdef HAVE_LZMA
+        lzma_stream ls;
+# endif
+# ifdef HAVE_ZSTD
+        ZSTD_DStream *zds;
+# endif
+    } lib;
+    unsigned char in[DECOMPRESS_BUF_SIZE];
+    const unsigned char *next_in;
+    size_t avail_in;
+    bool in_eof;
+    bool member_end;
+    bool finished;
+    const char *error;
+    struct {
+        char data[DECOMPRESS_BUF_SIZE];
+        size_t len;
+    } bufs[DECOMPRESS_BUFS];
+    unsigned int head;   /* buffer being read */
+    unsigned int filled; /* buffers ready to be read */
+    size_t pos;          /* read position within head buffer */
+    bool done;
+    bool cancel;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+/* Reported once the text decompressed before has been printed.  */
+static const char *decompress_error;
+#endif
+
 static char attr[MAX_ATTRIBUTE_CHARS + 1];
 static char *exclude;
 
@@ -326,6 +978,18 @@ static void conf_file_path (char **);
 static void process_opt_attr (const char *, const bool);
 static void write_attr (const struct attr *, unsigned int *, const bool);
 static void process_opt_exclude_random (const char *, const bool);
+static void process_opt_clean_all (const char *);
+static void process_opt_delimiter (const char *);
+static const struct color *find_fg_color (const char *, size_t, bool *);
+static void process_opt_field_colors (const char *);
+static void process_opt_flush (const char *);
+static void process_opt_rainbow (const char *);
+static void process_opt_hash_key (const char *);
+static void process_opt_lines (const char *);
+static void process_opt_max_fps (const char *);
+static void init_timestamp (void);
+static void format_timestamp (void);
+static void print_timestamp (void);
 static void parse_conf (const char *, struct conf *);
 static void assign_conf (const char *, struct conf *, const char *, char *);
 static void init_conf_vars (const char *, const struct conf *);
@@ -338,26 +1002,151 @@ static void cleanup (void);
 static void free_color_names (struct color_name **);
 static void free_conf (struct conf *);
 static void process_args (unsigned int, char **, char *, const struct color **, const char **, FILE **, struct conf *);
+static void process_color_string (const char *, char *, const struct color **);
+static void process_exec_args (const char *, const char **, FILE **);
 static void process_file_arg (const char *, const char **, FILE **);
+#ifdef HAVE_DECOMPRESS
+static void setup_decompress (const char *, FILE **);
+static void *decompress_thread (void *);
+static size_t decompress_fill (struct decompress *, char *, size_t);
+static bool decompress_input (struct decompress *);
+static enum decompress_status decompress_step (struct decompress *, char *, size_t, size_t *, size_t *);
+static ssize_t decompress_read (void *, char *, size_t);
+# ifndef HAVE_FOPENCOOKIE
+static int decompress_read_bsd (void *, char *, int);
+# endif
+static int decompress_close (void *);
+#endif
 static bool skip_path_colors (const char *, const char *, const struct stat *, const bool);
 static void gather_color_names (const char *, char *, struct color_name **);
+static void open_output (FILE *);
+static void close_output (void);
+static void clean_in_place (const char *);
+static size_t next_chunk (const char *, size_t, size_t, size_t);
+static char *clean_copy (char *, const char *, const char *);
+static int open_renamed (const char *, char **);
+static bool close_renamed (const char *, const struct stat *, char *, int, bool);
+static bool write_text_at (int, const char *, size_t, off_t);
+static char *clean_text (char *, const char *, const char *);
+static bool run_recursive (void);
+static void *walk_worker (void *);
+static bool walk_take (unsigned int, struct walk_task *);
+static void walk_push (unsigned int, enum walk_task_type, char *, struct walk_file *, size_t);
+static void walk_done (void);
+static void walk_fail (const char *);
+static void walk_dir (unsigned int, const char *);
+static void walk_file (unsigned int, char *);
+static void walk_chunk (struct walk_file *, size_t);
+static void walk_join (struct walk_file *);
+static void open_tee (FILE *);
+static void close_tee (void);
+static void tee_line (const char *, unsigned int);
+static void tee_write (const char *, size_t);
+static void open_html (void);
+static void open_out (void);
+static void close_out (void);
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t out_cookie_write (void *, const char *, size_t);
+#else
+static int out_cookie_write_bsd (void *, const char *, int);
+#endif
+static int out_cookie_close (void *);
+static bool write_out (const char *, size_t);
+static bool write_all (const char *, size_t);
+static void html_convert (const char *, size_t);
+static size_t html_esc (const char *, size_t);
+static void html_sync (void);
+static size_t html_style (char *, const struct sgr_state *);
+static size_t html_color (char *, const struct sgr_color *);
+static void html_put (const char *, size_t);
+static bool html_flush (void);
+static void open_frames (void);
+static void frame_add (const char *, size_t);
+static void frame_trim (void);
+static void frame_show (void);
+static int frame_due (void);
+static void frame_wait (FILE *);
+static void open_trace (void);
+static void trace_chunk (void);
+static void trace_written (size_t);
+static void hist_add (struct latency_hist *, const struct timespec *, const struct timespec *);
+static double hist_percentile (const struct latency_hist *, double);
+static void report_latency (void);
+static void setup_buffering (FILE *);
 static void read_print_stream (const char *, const struct color **, const char *, FILE *);
+static int run_exec (const char *);
+static bool exec_read (struct exec_stream *, const char *);
+static bool exec_hold (struct exec_stream *);
+static void exec_hold_room (struct exec_stream *, size_t);
+static struct exec_stream *exec_held (void);
+static void exec_drain (struct exec_stream *, const char *);
+static bool exec_print (struct exec_stream *, const char *, size_t);
+static char *print_lines_generic (const char *, const struct color **, const char *, char *, const char *, bool *);
+static char *print_lines_range (const char *, const struct color **, const char *, char *, const char *, bool *);
+static char *print_lines_clean (const char *, const struct color **, const char *, char *, const char *, bool *);
+static char *print_lines_color (const char *, const struct color **, const char *, char *, const char *, bool *);
+static char *print_lines_plain (const char *, const struct color **, const char *, char *, const char *, bool *);
+static char *print_lines_tee (const char *, const struct color **, const char *, char *, const char *, bool *);
+static void skip_lines (FILE *);
+static const char *skip_newlines (const char *, const char *, unsigned long *);
+static void print_untouched (const char *, unsigned int);
+static void copy_rest (const char *, char *, FILE *, bool);
+static size_t read_chunk (char *, size_t, FILE *, bool *);
+static bool input_pending (FILE *);
+static void flush_auto (FILE *);
 static void merge_print_line (const char *, const char *, FILE *);
 static void complete_part_line (const char *, char **, FILE *);
+static void complete_part_esc (const char *, char **, FILE *);
+static const char *find_part_esc (const char *);
 static bool get_next_char (char *, const char **, FILE *, bool *);
+static void unget_char (char, FILE *);
 static void save_char (char, char **, size_t *, size_t *);
 static void find_color_entries (struct color_name **, const struct color **);
 static void find_color_entry (const struct color_name *, unsigned int, const struct color **);
+static void init_hash_palette (const struct color **);
+static const struct color *hash_color (const char *);
+static bool find_hash_key (const char *, const char **, size_t *);
+static void select_print_funcs (const char *, const struct color **);
+static void select_exec_print_funcs (void);
 static void print_line (const char *, const struct color **, const char * const, unsigned int, bool);
+static void print_line_clean (const char *, const struct color **, const char * const, unsigned int, bool);
+static void print_line_color (const char *, const struct color **, const char * const, unsigned int, bool);
+static void print_line_plain (const char *, const struct color **, const char * const, unsigned int, bool);
+static char *print_lines_gather (const char *, const struct color **, const char *, char *, const char *, bool *);
+static void print_line_gather (const char *, const struct color **, const char * const, unsigned int, bool);
+static void gather_line (const char *, size_t, unsigned int, bool);
+static void gather_put (const char *, size_t);
+static void gather_flush (void);
+static void print_fields (const char *, unsigned int);
+static void init_rainbow_units (const char *, const struct color **);
+static void print_rainbow_units (const char *, unsigned int, bool);
+static unsigned int find_unit_starts (const char *, unsigned int, bool *);
+static const char *find_delimiter (const char *, const char *, char);
+static void init_scanners (void);
+static void select_scanner (const char *);
+static const char *find_esc_eol_scalar (const char *, const char *);
+#ifdef __SSE2__
+static const char *find_esc_eol_sse2 (const char *, const char *);
+#endif
+#ifdef HAVE_CPU_DISPATCH
+static const char *find_esc_eol_avx2 (const char *, const char *) __attribute__ ((target ("avx2")));
+static const char *find_esc_eol_avx512 (const char *, const char *) __attribute__ ((target ("avx512bw")));
+#endif
 static unsigned int get_rainbow_index (const struct color **, unsigned int, unsigned int, unsigned int);
 static bool skipable_rainbow_index (const struct color **, unsigned int, unsigned int);
-static void print_clean (const char *);
-static bool is_esc (const char *);
-static const char *get_end_of_esc (const char *);
+static const char *match_esc (const char *);
+static const char *match_esc_clean (const char *);
+static void print_normalized (const char *, unsigned int);
+static bool apply_sgr (const char *, const char *, struct sgr_state *);
+static bool apply_sgr_color (unsigned long *, unsigned int, unsigned int *, struct sgr_color *);
+static bool sgr_color_equal (const struct sgr_color *, const struct sgr_color *);
+static void print_sgr_diff (void);
+static size_t format_sgr_color (char *, unsigned int, const struct sgr_color *);
 static const char *get_end_of_text (const char *);
 static void print_text (const char *, size_t);
 static bool gather_esc_offsets (const char *, const char **, const char **);
-static bool validate_esc_clean_all (const char **);
+static enum esc_state scan_esc (const char *, const char **);
+static bool validate_esc_sgr (const char **);
 static bool validate_esc_clean (int, unsigned int, unsigned int *, const char **, bool *);
 static bool is_reset (int, unsigned int, const char **);
 static bool is_attr (int, unsigned int, unsigned int, const char **);
@@ -384,11 +1173,48 @@ static void vfprintf_diag (const char *, ...);
 static void vfprintf_fail (const char *, ...);
 static void stack (struct var_list **, unsigned int *, unsigned int, void *, enum var_type);
 static void release (struct var_list *, unsigned int, void **);
+#ifdef FUZZ
+static size_t fuzz_chunk_size (void);
+#endif
 
+/* Chosen by select_print_funcs() once options have been processed.  */
+static char *(*print_lines) (const char *, const struct color **, const char *, char *, const char *, bool *) = print_lines_generic;
+static void (*print_line_func) (const char *, const struct color **, const char * const, unsigned int, bool) = print_line;
+
+/* Chosen by select_scanner() according to the CPU (or --scanner).  */
+static const char *(*find_esc_eol) (const char *, const char *) = find_esc_eol_scalar;
+static const char *scanner_name = "scalar";
+static struct {
+    const char *name;
+    const char *(*func) (const char *, const char *);
+    bool usable;
+} scanners[4];
+static unsigned int scanner_count;
+
+/* Same colors for each line, written with writev(): text of lines from
+   GATHER_MIN bytes on is passed from the input buffer, shorter text and
+   sequences are staged.  */
+#define GATHER_MIN 256
+#define GATHER_IOV 64
+static bool gather_output;
+static struct {
+    struct iovec iov[GATHER_IOV];
+    unsigned int iov_cnt;
+    char stage[BUF_SIZE];
+    size_t stage_len;
+} gather;
+
+/* The fuzz and bench drivers have a main() of their own; this one is
+   built under another name there, so that what it alone calls is
+   neither unused nor assumed unreachable.  */
+#if defined (FUZZ) || defined (BENCH)
+# define main main_regular
+#endif
 int
 main (int argc, char **argv)
 {
     unsigned int arg_cnt;
+    int status = EXIT_SUCCESS;
 
     const struct color *colors[2] = {
         NULL, /* foreground */
@@ -401,10 +1227,9 @@ main (int argc, char **argv)
     struct conf config = { NULL, NULL, NULL, NULL, NULL, NULL };
 
     program_name = argv[0];
+    out = stdout;
     atexit (cleanup);
 
-    setvbuf (stdout, NULL, _IOLBF, 0);
-
 #if DEBUG
     log = open_file (DEBUG_FILE, "w");
     print_tstamp (log);
@@ -455,12 +1280,53 @@ main (int argc, char **argv)
 
     arg_cnt = argc - optind;
 
-    if (clean || clean_all)
+    if ((html || trace_latency) && output_direct)
+      {
+        vfprintf_diag ("--direct switch has no meaning with --%s", html ? "html" : "trace-latency");
+        output_direct = false;
+      }
+    if (output_file)
+      {
+        /* Aligned writes of the whole buffer only.  */
+        if (output_direct && (opts_set & OPT_FLUSH_SET) && flush_mode != FLUSH_FULL)
+          vfprintf_diag ("--flush switch has no meaning with --direct");
+        if (output_direct || !(opts_set & OPT_FLUSH_SET))
+          flush_mode = FLUSH_FULL;
+      }
+    else
+      {
+        unsigned int i;
+        const struct option_set {
+            const char *option;
+            enum opt_set set;
+        } options[] = {
+            { "direct",      OPT_DIRECT_SET      },
+            { "fsync",       OPT_FSYNC_SET       },
+            { "preallocate", OPT_PREALLOCATE_SET },
+        };
+        for (i = 0; i < COUNT_OF (options, struct option_set); i++)
+          if (opts_set & options[i].set)
+            vfprintf_diag ("--%s switch has no meaning without --output", options[i].option);
+      }
+    if ((opts_set & OPT_PASS_THROUGH_SET) && !lines_range)
+      vfprintf_diag ("--pass-through switch has no meaning without --lines");
+    if (minimal_escapes && rainbow_unit != RAINBOW_LINE)
+      {
+        vfprintf_diag ("--minimal-escapes switch has no meaning with --rainbow=char|word");
+        minimal_escapes = false;
+      }
+    if (tee_file && pass_through)
+      vfprintf_fail (formats[FMT_GENERIC], "--tee and --pass-through switch are mutually exclusive");
+    if ((opts_set & OPT_DELIMITER_SET) && !field_colors && !hash_field)
+      vfprintf_diag ("--delimiter switch has no meaning without --field-colors or --hash-key=FIELD");
+
+    if (clean || clean_all || normalize || field_colors)
       {
-        if (clean && clean_all)
-          vfprintf_fail (formats[FMT_GENERIC], "--clean and --clean-all switch are mutually exclusive");
-        if (arg_cnt > 1)
-          vfprintf_fail ("--clean%s switch cannot be used with more than one file", clean_all ? "-all" : "");
+        const char *switch_name = clean ? "--clean" : clean_all ? "--clean-all" : normalize ? "--normalize" : "--field-colors";
+        if (clean + clean_all + normalize + field_colors > 1)
+          vfprintf_fail (formats[FMT_GENERIC], "--clean, --clean-all, --normalize and --field-colors switch are mutually exclusive");
+        if (arg_cnt > 1 && !in_place)
+          vfprintf_fail ("%s switch cannot be used with more than one file", switch_name);
         {
           unsigned int i;
           const struct option_set {
@@ -469,13 +1335,16 @@ main (int argc, char **argv)
           } options[] = {
               { "attr",             OPT_ATTR_SET             },
               { "exclude-random",   OPT_EXCLUDE_RANDOM_SET   },
+              { "hash-key",         OPT_HASH_KEY_SET         },
+              { "minimal-escapes",  OPT_MINIMAL_ESCAPES_SET  },
               { "omit-color-empty", OPT_OMIT_COLOR_EMPTY_SET },
+              { "rainbow",          OPT_RAINBOW_SET          },
               { "rainbow-fg",       OPT_RAINBOW_FG_SET       },
               { "rainbow-bg",       OPT_RAINBOW_BG_SET       },
           };
           for (i = 0; i < COUNT_OF (options, struct option_set); i++)
             if (opts_set & options[i].set)
-              vfprintf_diag ("--%s switch has no meaning with --clean%s", options[i].option, clean_all ? "-all" : "");
+              vfprintf_diag ("--%s switch has no meaning with %s", options[i].option, switch_name);
         }
       }
     else
@@ -485,27 +1354,120 @@ main (int argc, char **argv)
             !rainbow_from_conf.fg ? "--rainbow-fg switch" : "rainbow-fg conf option",
             !rainbow_from_conf.bg ? "--rainbow-bg switch" : "rainbow-bg conf option"
           );
+        if (hash_key && (rainbow_fg || rainbow_bg))
+          vfprintf_fail ("%s and --hash-key switch are mutually exclusive",
+            rainbow_fg ? !rainbow_from_conf.fg ? "--rainbow-fg switch" : "rainbow-fg conf option"
+                       : !rainbow_from_conf.bg ? "--rainbow-bg switch" : "rainbow-bg conf option"
+          );
 
-        if (arg_cnt == 0 || arg_cnt > 2)
+        if (exec_command && arg_cnt > 1)
+          {
+            vfprintf_diag ("%u arguments provided, expected 0-1 arguments with --exec", arg_cnt);
+            print_hint ();
+            exit (EXIT_FAILURE);
+          }
+        else if (!exec_command && (arg_cnt == 0 || arg_cnt > 2))
           {
-            vfprintf_diag ("%u arguments provided, expected 1-2 arguments or --clean[-all]", arg_cnt);
+            vfprintf_diag ("%u arguments provided, expected 1-2 arguments or --clean[-all]/--normalize", arg_cnt);
             print_hint ();
             exit (EXIT_FAILURE);
           }
       }
+    if (exec_command)
+      {
+        if (lines_range)
+          vfprintf_fail (formats[FMT_GENERIC], "--exec and --lines switch are mutually exclusive");
+        if ((clean || clean_all || normalize || field_colors) && arg_cnt)
+          vfprintf_fail ("%u arguments provided, expected none with --exec and --clean[-all]/--normalize/--field-colors", arg_cnt);
+      }
+    else if (exec_streams[0].color_string || exec_streams[1].color_string)
+      vfprintf_diag ("--stdout and --stderr switch have no meaning without --exec");
 
-    if (clean || clean_all)
+    if (recursive_dir)
+      {
+        if (!(clean || clean_all))
+          vfprintf_fail (formats[FMT_GENERIC], "--recursive switch requires --clean or --clean-all");
+        if (!in_place == !output_file)
+          vfprintf_fail (formats[FMT_GENERIC], "--recursive switch requires either --in-place or --output");
+        if (tee_file || exec_command)
+          vfprintf_fail (formats[FMT_GENERIC], "--recursive switch cannot be combined with --tee or --exec");
+        if (arg_cnt)
+          vfprintf_fail ("%u arguments provided, expected none with --recursive", arg_cnt);
+        exit (run_recursive () ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+    if (in_place)
+      {
+        unsigned int i;
+        if (!(clean || clean_all))
+          vfprintf_fail (formats[FMT_GENERIC], "--in-place switch requires --clean or --clean-all");
+        if (output_file || tee_file || exec_command)
+          vfprintf_fail (formats[FMT_GENERIC], "--in-place switch cannot be combined with --output, --tee or --exec");
+        if (arg_cnt == 0)
+          vfprintf_fail (formats[FMT_GENERIC], "--in-place switch requires one or more files");
+        for (i = 0; i < arg_cnt; i++)
+          clean_in_place (argv[optind + i]);
+        exit (EXIT_SUCCESS);
+      }
+    if (exec_command)
+      {
+        process_exec_args (arg_cnt ? argv[optind] : NULL, &file, &stream);
+        colors[FOREGROUND] = exec_streams[0].colors[FOREGROUND];
+        colors[BACKGROUND] = exec_streams[0].colors[BACKGROUND];
+      }
+    else if (clean || clean_all || normalize || field_colors)
       process_file_arg (argv[optind], &file, &stream);
     else
       process_args (arg_cnt, &argv[optind], &attr[0], colors, &file, &stream, &config);
-    read_print_stream (&attr[0], colors, file, stream);
+    if (hash_key)
+      init_hash_palette (colors);
+    if (tee_file)
+      open_tee (stream);
+    if (trace_latency)
+      open_trace ();
+    /* stdout is written directly unless hooked or buffered for -o */
+    gather_output = !html && !trace_latency && !frame_rate && !output_file;
+    if (exec_command && !(clean || clean_all || normalize || field_colors))
+      select_exec_print_funcs ();
+    else
+      select_print_funcs (&attr[0], colors);
+    if (output_file)
+      open_output (stream);
+    if (html)
+      open_html ();
+    if (frame_rate)
+      open_frames ();
+    if (html || trace_latency || frame_rate)
+      open_out ();
+    setup_buffering (stream);
+    if (exec_command)
+      status = run_exec (file);
+    else
+      read_print_stream (&attr[0], colors, file, stream);
+    if (html || trace_latency || frame_rate)
+      close_out ();
+    if (output_file)
+      close_output ();
+    if (tee_file)
+      close_tee ();
+    if (trace_latency)
+      report_latency ();
+#ifdef HAVE_DECOMPRESS
+    if (decompress_error)
+      {
+        fflush (stdout);
+        vfprintf_fail (formats[FMT_FILE], file, decompress_error);
+      }
+#endif
 
     free_conf (&config);
 
     RELEASE (exclude);
 
-    exit (EXIT_SUCCESS);
+    exit (status);
 }
+#if defined (FUZZ) || defined (BENCH)
+# undef main
+#endif
 
 #if DEBUG
 static void
@@ -538,6 +1500,12 @@ print_tstamp (FILE *log)
     *conf_file = xstrdup (optarg); \
     break;
 
+#define DUP_OUTPUT()                \
+    RELEASE (output_file);          \
+    output_file = xstrdup (optarg); \
+    STACK_VAR (output_file);        \
+    break;
+
 #define PRINT_HELP_EXIT() \
     print_help ();        \
     exit (EXIT_SUCCESS);
@@ -550,7 +1518,7 @@ static void
 process_opts (int argc, char **argv, char **conf_file)
 {
     int opt;
-    while ((opt = getopt_long (argc, argv, "c:hV", long_opts, NULL)) != -1)
+    while ((opt = getopt_long (argc, argv, "c:ho:V", long_opts, NULL)) != -1)
       {
         switch (opt)
           {
@@ -567,23 +1535,144 @@ process_opts (int argc, char **argv, char **conf_file)
                     break;
                   case OPT_CLEAN_ALL:
                     clean_all = true;
+                    if (optarg)
+                      {
+                        opts_arg.clean_all = xstrdup (optarg);
+                        STACK_VAR (opts_arg.clean_all);
+                      }
                     break;
                   case OPT_CONFIG:
                     DUP_CONFIG ();
+                  case OPT_DELIMITER:
+                    opts_set |= OPT_DELIMITER_SET;
+                    opts_arg.delimiter = xstrdup (optarg);
+                    STACK_VAR (opts_arg.delimiter);
+                    break;
+                  case OPT_DIRECT:
+                    opts_set |= OPT_DIRECT_SET;
+                    break;
                   case OPT_EXCLUDE_RANDOM:
                     opts_set |= OPT_EXCLUDE_RANDOM_SET;
                     opts_arg.exclude_random = xstrdup (optarg);
                     STACK_VAR (opts_arg.exclude_random);
                     break;
+                  case OPT_EXEC:
+                    RELEASE (exec_command);
+                    exec_command = xstrdup (optarg);
+                    STACK_VAR (exec_command);
+                    break;
+                  case OPT_FIELD_COLORS:
+                    field_colors = true;
+                    opts_arg.field_colors = xstrdup (optarg);
+                    STACK_VAR (opts_arg.field_colors);
+                    break;
+                  case OPT_FLUSH:
+                    opts_set |= OPT_FLUSH_SET;
+                    opts_arg.flush = xstrdup (optarg);
+                    STACK_VAR (opts_arg.flush);
+                    break;
+                  case OPT_FSYNC:
+                    opts_set |= OPT_FSYNC_SET;
+                    break;
+                  case OPT_HASH_KEY:
+                    opts_set |= OPT_HASH_KEY_SET;
+                    opts_arg.hash_key = xstrdup (optarg);
+                    STACK_VAR (opts_arg.hash_key);
+                    break;
+                  case OPT_HTML:
+                    opts_set |= OPT_HTML_SET;
+                    break;
+                  case OPT_IN_PLACE:
+                    in_place = IN_PLACE_TRUNCATE;
+                    RELEASE (opts_arg.in_place);
+                    if (optarg)
+                      {
+                        opts_arg.in_place = xstrdup (optarg);
+                        STACK_VAR (opts_arg.in_place);
+                      }
+                    break;
+                  case OPT_LINES:
+                    opts_arg.lines = xstrdup (optarg);
+                    STACK_VAR (opts_arg.lines);
+                    break;
+                  case OPT_MAX_FPS:
+                    opts_arg.max_fps = xstrdup (optarg);
+                    STACK_VAR (opts_arg.max_fps);
+                    break;
+                  case OPT_MINIMAL_ESCAPES:
+                    opts_set |= OPT_MINIMAL_ESCAPES_SET;
+                    break;
+                  case OPT_NORMALIZE:
+                    normalize = true;
+                    break;
                   case OPT_OMIT_COLOR_EMPTY:
                     opts_set |= OPT_OMIT_COLOR_EMPTY_SET;
                     break;
+                  case OPT_OUTPUT:
+                    DUP_OUTPUT ();
+                  case OPT_PASS_THROUGH:
+                    opts_set |= OPT_PASS_THROUGH_SET;
+                    break;
+                  case OPT_PREALLOCATE:
+                    opts_set |= OPT_PREALLOCATE_SET;
+                    break;
+                  case OPT_RAINBOW:
+                    opts_set |= OPT_RAINBOW_SET;
+                    opts_arg.rainbow = xstrdup (optarg);
+                    STACK_VAR (opts_arg.rainbow);
+                    break;
                   case OPT_RAINBOW_FG:
                     opts_set |= OPT_RAINBOW_FG_SET;
                     break;
                   case OPT_RAINBOW_BG:
                     opts_set |= OPT_RAINBOW_BG_SET;
                     break;
+                  case OPT_RECURSIVE:
+                    RELEASE (recursive_dir);
+                    recursive_dir = xstrdup (optarg);
+                    STACK_VAR (recursive_dir);
+                    break;
+                  case OPT_SCANNER:
+                    opts_arg.scanner = xstrdup (optarg);
+                    STACK_VAR (opts_arg.scanner);
+                    break;
+                  case OPT_STDERR:
+                  case OPT_STDOUT:
+                    {
+                      struct exec_stream *exec_stream = &exec_streams[opt_type == OPT_STDOUT ? 0 : 1];
+                      RELEASE (exec_stream->color_string);
+                      exec_stream->color_string = xstrdup (optarg);
+                      STACK_VAR (exec_stream->color_string);
+                      break;
+                    }
+                  case OPT_TEE:
+                    RELEASE (tee_file);
+                    tee_file = xstrdup (optarg);
+                    STACK_VAR (tee_file);
+                    break;
+                  case OPT_TIMESTAMP:
+                    timestamp = true;
+                    RELEASE (timestamp_format);
+                    if (optarg)
+                      {
+                        timestamp_format = xstrdup (optarg);
+                        STACK_VAR (timestamp_format);
+                      }
+                    break;
+                  case OPT_TIMESTAMP_COLOR:
+                    RELEASE (timestamp_color);
+                    timestamp_color = xstrdup (optarg);
+                    STACK_VAR (timestamp_color);
+                    break;
+                  case OPT_TRACE_LATENCY:
+                    opts_set |= OPT_TRACE_LATENCY_SET;
+                    RELEASE (trace_file);
+                    if (optarg)
+                      {
+                        trace_file = xstrdup (optarg);
+                        STACK_VAR (trace_file);
+                      }
+                    break;
                   case OPT_HELP:
                     PRINT_HELP_EXIT ();
                   case OPT_VERSION:
@@ -596,6 +1685,8 @@ process_opts (int argc, char **argv, char **conf_file)
               DUP_CONFIG ();
             case 'h':
               PRINT_HELP_EXIT ();
+            case 'o':
+              DUP_OUTPUT ();
             case 'V':
               PRINT_VERSION_EXIT ();
             case '?':
@@ -723,6 +1814,173 @@ process_opt_exclude_random (const char *s, const bool is_opt)
                      is_opt ? "--exclude-random switch" : "exclude-random conf option");
 }
 
+static void
+process_opt_clean_all (const char *p)
+{
+    const struct {
+        const char *name;
+        enum esc_seq seq;
+    } seqs[] = {
+        { "sgr", SEQ_SGR },
+        { "csi", SEQ_CSI },
+        { "osc", SEQ_OSC },
+        { "dcs", SEQ_DCS },
+        { "esc", SEQ_ESC },
+    };
+
+    /* neither empty nor ending with , */
+    clean_all_seqs = 0;
+    for (;;)
+      {
+        const char *s;
+        bool valid_seq = false;
+        unsigned int i;
+        if (!isalpha ((unsigned char)*p))
+          vfprintf_fail ("--clean-all switch must be provided a string");
+        s = p;
+        while (isalpha ((unsigned char)*p))
+          p++;
+        if (*p != '\0' && *p != ',')
+          vfprintf_fail ("--clean-all switch must have strings separated by ,");
+        for (i = 0; i < COUNT_OF (seqs, seqs[0]); i++)
+          if ((size_t)(p - s) == strlen (seqs[i].name) && strneq (s, seqs[i].name, p - s))
+            {
+              clean_all_seqs |= seqs[i].seq;
+              valid_seq = true;
+              break;
+            }
+        if (!valid_seq)
+          vfprintf_fail ("--clean-all switch sequence type '%.*s' is not valid", (int)(p - s), s);
+        if (!*p)
+          break;
+        p++;
+      }
+}
+
+static void
+process_opt_delimiter (const char *s)
+{
+    if (streq (s, "TAB"))
+      field_delimiter = '\t';
+    else if (streq (s, "SPACE"))
+      {
+        field_delimiter = ' ';
+        field_delimiter_run = true;
+      }
+    else if (strlen (s) == 1 && *s != '\n' && *s != '\r' && *s != '\033')
+      field_delimiter = *s;
+    else
+      vfprintf_fail ("--delimiter switch must be provided TAB, SPACE or a single character");
+}
+
+/* First character in upper case denotes increased intensity.  */
+static const struct color *
+find_fg_color (const char *name, size_t len, bool *bold)
+{
+    unsigned int i;
+
+    *bold = len && isupper ((unsigned char)*name);
+    for (i = 0; i < tables[FOREGROUND].count; i++)
+      {
+        const struct color *e = &tables[FOREGROUND].entries[i];
+        if (len == strlen (e->name)
+         && tolower ((unsigned char)*name) == *e->name
+         && strneq (name + 1, e->name + 1, len - 1))
+          return (*bold && !e->code) ? NULL : e;
+      }
+    return NULL;
+}
+
+static void
+process_opt_field_colors (const char *p)
+{
+    while (*p)
+      {
+        const struct color *entry;
+        const char *s, *name;
+        unsigned long field;
+        bool bold;
+
+        s = p;
+        if (*p == '*')
+          {
+            field = 0;
+            p++;
+          }
+        else if (isdigit ((unsigned char)*p))
+          {
+            char *end;
+            field = strtoul (p, &end, 10);
+            p = end;
+            if (field == 0 || field > MAX_FIELD_NUMBER)
+              vfprintf_fail ("--field-colors switch field '%.*s' is not valid", (int)(p - s), s);
+          }
+        else
+          vfprintf_fail ("--field-colors switch must be provided FIELD=COLOR pairs separated by ,");
+        if (*p++ != '=')
+          vfprintf_fail ("--field-colors switch must be provided FIELD=COLOR pairs separated by ,");
+
+        name = p;
+        while (isalpha ((unsigned char)*p))
+          p++;
+        if (*p != '\0' && *p != ',')
+          vfprintf_fail ("--field-colors switch must be provided FIELD=COLOR pairs separated by ,");
+        if (!(entry = find_fg_color (name, p - name, &bold)))
+          vfprintf_fail ("--field-colors switch color '%.*s' is not valid", (int)(p - name), name);
+
+        if (!field_seqs || field > field_max)
+          {
+            const unsigned int max = field > field_max ? field : field_max;
+            struct field_seq *seqs = xcalloc (max + 1, sizeof (struct field_seq));
+            if (field_seqs)
+              memcpy (seqs, field_seqs, (field_max + 1) * sizeof (struct field_seq));
+            RELEASE (field_seqs);
+            field_seqs = seqs;
+            STACK_VAR (field_seqs);
+            field_max = max;
+          }
+        if (field_seqs[field].set)
+          vfprintf_fail ("--field-colors switch has field '%.*s' twice or more", (int)(name - 1 - s), s);
+        field_seqs[field].set = true;
+        if (entry->code)
+          snprintf (field_seqs[field].seq, sizeof (field_seqs[field].seq), "\033[%s%s", bold ? "1;" : "", entry->code);
+
+        if (*p)
+          p++;
+      }
+    if (!field_seqs)
+      vfprintf_fail ("--field-colors switch must be provided FIELD=COLOR pairs separated by ,");
+}
+
+static void
+process_opt_flush (const char *s)
+{
+    if (streq (s, "line"))
+      flush_mode = FLUSH_LINE;
+    else if (streq (s, "auto"))
+      flush_mode = FLUSH_AUTO;
+    else if (streq (s, "full"))
+      flush_mode = FLUSH_FULL;
+    else
+      vfprintf_fail ("--flush switch must be provided line, auto or full");
+}
+
+static void
+process_opt_rainbow (const char *s)
+{
+    if (streq (s, "line"))
+      rainbow_unit = RAINBOW_LINE;
+    else if (streq (s, "char"))
+      rainbow_unit = RAINBOW_CHAR;
+    else if (streq (s, "word"))
+      rainbow_unit = RAINBOW_WORD;
+    else
+      vfprintf_fail ("--rainbow switch must be provided line, char or word");
+    /* foreground unless background is chosen */
+    if (!rainbow_fg && !rainbow_bg)
+      rainbow_fg = true;
+}
+
 static void
 init_opts_vars (void)
 {
@@ -733,37 +1991,228 @@ init_opts_vars (void)
       }
     if (opts_set & OPT_EXCLUDE_RANDOM_SET)
       process_opt_exclude_random (opts_arg.exclude_random, true);
+    if (opts_arg.clean_all)
+      process_opt_clean_all (opts_arg.clean_all);
+    if (opts_set & OPT_DELIMITER_SET)
+      process_opt_delimiter (opts_arg.delimiter);
+    if (opts_arg.field_colors)
+      process_opt_field_colors (opts_arg.field_colors);
+    if (opts_set & OPT_FLUSH_SET)
+      process_opt_flush (opts_arg.flush);
+    if (opts_set & OPT_HASH_KEY_SET)
+      process_opt_hash_key (opts_arg.hash_key);
+    if (opts_arg.lines)
+      process_opt_lines (opts_arg.lines);
+    if (opts_arg.max_fps)
+      process_opt_max_fps (opts_arg.max_fps);
+    if (opts_arg.in_place)
+      {
+        if (streq (opts_arg.in_place, "rename"))
+          in_place = IN_PLACE_RENAME;
+        else if (!streq (opts_arg.in_place, "truncate"))
+          vfprintf_fail ("--in-place switch must be provided truncate or rename");
+      }
+    if (timestamp)
+      init_timestamp ();
+    else if (timestamp_color)
+      vfprintf_diag ("--timestamp-color switch has no meaning without --timestamp");
+    select_scanner (opts_arg.scanner);
+    if (opts_set & OPT_MINIMAL_ESCAPES_SET)
+      minimal_escapes = true;
     if (opts_set & OPT_OMIT_COLOR_EMPTY_SET)
       omit_color_empty = true;
+    if (opts_set & OPT_PASS_THROUGH_SET)
+      pass_through = true;
+    if (opts_set & OPT_DIRECT_SET)
+      output_direct = true;
+    if (opts_set & OPT_HTML_SET)
+      html = true;
+    if (opts_set & OPT_TRACE_LATENCY_SET)
+      trace_latency = true;
+    if (opts_set & OPT_FSYNC_SET)
+      output_fsync = true;
+    if (opts_set & OPT_PREALLOCATE_SET)
+      output_preallocate = true;
     if (opts_set & OPT_RAINBOW_FG_SET)
       rainbow_fg = true;
     if (opts_set & OPT_RAINBOW_BG_SET)
       rainbow_bg = true;
+    if (opts_set & OPT_RAINBOW_SET)
+      process_opt_rainbow (opts_arg.rainbow);
 
     RELEASE (opts_arg.attr);
+    RELEASE (opts_arg.clean_all);
+    RELEASE (opts_arg.delimiter);
     RELEASE (opts_arg.exclude_random);
+    RELEASE (opts_arg.field_colors);
+    RELEASE (opts_arg.flush);
+    RELEASE (opts_arg.hash_key);
+    RELEASE (opts_arg.in_place);
+    RELEASE (opts_arg.lines);
+    RELEASE (opts_arg.max_fps);
+    RELEASE (opts_arg.rainbow);
+    RELEASE (opts_arg.scanner);
 }
 
-#define IS_SPACE(c) ((c) == ' ' || (c) == '\t')
+static void
+process_opt_hash_key (const char *s)
+{
+    if (*s == '\0')
+      vfprintf_fail ("--hash-key switch must be provided a field number or regex");
+    else if (strspn (s, "0123456789") == strlen (s))
+      {
+        const unsigned long field = strtoul (s, NULL, 10);
+        if (field == 0 || field > MAX_FIELD_NUMBER)
+          vfprintf_fail ("--hash-key switch field '%s' is not valid", s);
+        hash_field = field;
+      }
+    else
+      {
+        int ret;
+        if ((ret = regcomp (&hash_regex, s, REG_EXTENDED)) != 0)
+          {
+            char errbuf[128];
+            regerror (ret, &hash_regex, errbuf, sizeof (errbuf));
+            vfprintf_fail ("--hash-key switch regex '%s': %s", s, errbuf);
+          }
+        hash_regex_compiled = true;
+      }
+    hash_key = true;
+}
 
 static void
-parse_conf (const char *conf_file, struct conf *config)
+process_opt_lines (const char *s)
 {
-    unsigned int cnt = 0;
-    char line[256 + 1];
-    FILE *conf;
+    const char *p = s;
+    char *end;
 
-    conf = open_file (conf_file, "r");
-    STACK_FILE (conf);
+    /* START-END, START- or -N  */
+    if (isdigit ((unsigned char)*p))
+      {
+        errno = 0;
+        lines_start = strtoul (p, &end, 10);
+        if (errno == ERANGE || lines_start == 0)
+          vfprintf_fail ("--lines switch start '%.*s' is not valid", (int)(end - p), p);
+        p = end;
+      }
+    if (*p++ != '-' || (p == s + 1 && !isdigit ((unsigned char)*p)))
+      vfprintf_fail ("--lines switch must be provided START-END, START- or -N");
+    if (isdigit ((unsigned char)*p))
+      {
+        errno = 0;
+        lines_end = strtoul (p, &end, 10);
+        if (errno == ERANGE || lines_end < lines_start)
+          vfprintf_fail ("--lines switch end '%.*s' is not valid", (int)(end - p), p);
+        p = end;
+      }
+    if (*p != '\0')
+      vfprintf_fail ("--lines switch must be provided START-END, START- or -N");
 
-    while (fgets (line, sizeof (line), conf))
+    lines_range = true;
+}
+
+static void
+process_opt_max_fps (const char *s)
+{
+    char *end;
+    unsigned long rate;
+
+    /* N or N,LINES */
+    if (!isdigit ((unsigned char)*s))
+      vfprintf_fail ("--max-fps switch must be provided N or N,LINES");
+    errno = 0;
+    rate = strtoul (s, &end, 10);
+    if (errno == ERANGE || rate == 0 || rate > 1000)
+      vfprintf_fail ("--max-fps switch rate '%.*s' is not valid", (int)(end - s), s);
+    if (*end == ',')
       {
-        char *cfg, *val;
-        char *assign, *comment, *opt, *value;
-        char *p;
+        const char *p = end + 1;
+        if (!isdigit ((unsigned char)*p))
+          vfprintf_fail ("--max-fps switch must be provided N or N,LINES");
+        errno = 0;
+        frame_backlog = strtoul (p, &end, 10);
+        if (errno == ERANGE || frame_backlog == 0)
+          vfprintf_fail ("--max-fps switch backlog '%.*s' is not valid", (int)(end - p), p);
+      }
+    if (*end != '\0')
+      vfprintf_fail ("--max-fps switch must be provided N or N,LINES");
 
-        cnt++;
-        if ((p = strchr (line, '\r')) && *(p + 1) != '\n')
+    frame_rate = rate;
+}
+
+/* A fraction of the second splits the format in two parts, which are
+   formatted around it.  */
+static void
+init_timestamp (void)
+{
+    const char *format = timestamp_format ? timestamp_format : TIMESTAMP_DEFAULT;
+    const char *p = format;
+
+    while ((p = strchr (p, '%')))
+      {
+        if (*(p + 1) == '.' && *(p + 2) && strchr ("STs", *(p + 2)))
+          {
+            const size_t len = p - format;
+            stamp.head = xmalloc (len + 3);
+            STACK_VAR (stamp.head);
+            memcpy (stamp.head, format, len);
+            stamp.head[len] = '%';
+            stamp.head[len + 1] = *(p + 2);
+            stamp.head[len + 2] = '\0';
+            stamp.tail = p + 3;
+            stamp.fraction = true;
+            break;
+          }
+        p += *(p + 1) ? 2 : 1;
+      }
+    if (!stamp.fraction)
+      {
+        stamp.head = xstrdup (format);
+        STACK_VAR (stamp.head);
+        stamp.tail = "";
+      }
+
+    clock_gettime (CLOCK_REALTIME, &stamp.now);
+    format_timestamp ();
+    if (stamp.len == 0)
+      vfprintf_fail ("--timestamp switch format '%s' is not valid", format);
+
+    if (timestamp_color)
+      {
+        bool bold;
+        const struct color *entry = find_fg_color (timestamp_color, strlen (timestamp_color), &bold);
+        if (!entry)
+          vfprintf_fail ("--timestamp-color switch color '%s' is not valid", timestamp_color);
+        if (entry->code)
+          snprintf (timestamp_seq, sizeof (timestamp_seq), "\033[%s%s", bold ? "1;" : "", entry->code);
+        else
+          *timestamp_seq = '\0';
+      }
+    /* --clean[-all]: no sequences in output */
+    if (clean || clean_all)
+      *timestamp_seq = '\0';
+}
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t')
+
+static void
+parse_conf (const char *conf_file, struct conf *config)
+{
+    unsigned int cnt = 0;
+    char line[256 + 1];
+    FILE *conf;
+
+    conf = open_file (conf_file, "r");
+    STACK_FILE (conf);
+
+    while (fgets (line, sizeof (line), conf))
+      {
+        char *cfg, *val;
+        char *assign, *comment, *opt, *value;
+        char *p;
+
+        cnt++;
+        if ((p = strchr (line, '\r')) && *(p + 1) != '\n')
           vfprintf_fail ("%s: CR ending of line %u is not supported, switch to CRLF/LF instead", conf_file, cnt);
         if (strlen (line) > (sizeof (line) - 2))
           vfprintf_fail ("%s: line %u exceeds maximum of %u characters", conf_file, cnt, (unsigned int)(sizeof (line) - 2));
@@ -905,15 +2354,33 @@ print_help (void)
     };
     const struct opt_data opts_data[] = {
         { "attr",           NULL, "=ATTR1,ATTR2,..." },
+        { "clean-all",      NULL, "[=SEQ1,SEQ2,...]" },
         { "config",         "c",  "=PATH"            },
+        { "delimiter",      NULL, "=TAB|SPACE|CHAR"  },
         { "exclude-random", NULL, "=COLOR"           },
+        { "exec",           NULL, "=COMMAND"         },
+        { "field-colors",   NULL, "=FIELD=COLOR,..." },
+        { "flush",          NULL, "=line|auto|full"  },
+        { "hash-key",       NULL, "=FIELD|REGEX"     },
+        { "in-place",       NULL, "[=truncate|rename]" },
+        { "lines",          NULL, "=START-END|-N"    },
+        { "max-fps",        NULL, "=N[,LINES]"       },
+        { "rainbow",        NULL, "=line|char|word"  },
+        { "recursive",      NULL, "=DIR"             },
+        { "output",         "o",  "=FILE"            },
+        { "stdout",         NULL, "=COLOR"           },
+        { "stderr",         NULL, "=COLOR"           },
+        { "tee",            NULL, "=FILE"            },
+        { "timestamp",      NULL, "[=FORMAT]"        },
+        { "timestamp-color", NULL, "=COLOR"          },
+        { "trace-latency",  NULL, "[=FILE]"          },
         { "help",           "h",  NULL               },
         { "version",        "V",  NULL               },
     };
     const struct option *opt = long_opts;
     unsigned int i;
 
-    printf ("Usage: %s (foreground) OR (foreground)%c(background) OR --clean[-all] [-|file]\n\n", program_name, COLOR_SEP_CHAR);
+    printf ("Usage: %s (foreground) OR (foreground)%c(background) OR --clean[-all]|--normalize|--field-colors [-|file]\n\n", program_name, COLOR_SEP_CHAR);
     printf ("\tColors (foreground) (background)\n");
     for (i = 0; i < tables[FOREGROUND].count; i++)
       {
@@ -936,6 +2403,9 @@ print_help (void)
       {
         const struct opt_data *opt_data = NULL;
         unsigned int i;
+        /* --scanner is for benchmarking only */
+        if (opt->val == OPT_SCANNER)
+          continue;
         for (i = 0; i < COUNT_OF (opts_data, struct opt_data); i++)
           if (streq (opt->name, opts_data[i].name))
             {
@@ -1008,7 +2478,21 @@ print_version (void)
       }
     else
       printf ("Buffer size: %lu byte%s\n", (unsigned long)BUF_SIZE, BUF_SIZE > 1 ? "s" : "");
+    printf ("Flush deadline: %ums\n", (unsigned int)FLUSH_DEADLINE);
     printf ("Color separator: '%c'\n", COLOR_SEP_CHAR);
+#ifdef HAVE_DECOMPRESS
+    {
+        unsigned int i;
+        printf ("Decompression: ");
+        for (i = 0; i < COUNT_OF (compressions, compressions[0]); i++)
+          printf ("%s%s", i ? ", " : "", compressions[i].name);
+        printf ("\n");
+    }
+#else
+    printf ("Decompression: none\n");
+#endif
+    select_scanner (NULL);
+    printf ("ESC scanner: %s\n", scanner_name);
     printf ("Debugging: %s\n", debug ? "yes" : "no");
 }
 
@@ -1017,6 +2501,8 @@ cleanup (void)
 {
     if (stream && fileno (stream) != STDIN_FILENO)
       RELEASE (stream);
+    if (hash_regex_compiled)
+      regfree (&hash_regex);
 #if DEBUG
     if (log)
       RELEASE (log);
@@ -1074,13 +2560,7 @@ process_args (unsigned int arg_cnt, char **arg_strings, char *attr, const struct
 {
     bool has_hyphen, use_conf_color;
     int ret;
-    char *p;
     struct stat sb;
-    struct color_name *color_names[3] = {
-        NULL, /* foreground */
-        NULL, /* background */
-        NULL, /* sentinel value */
-    };
 
     const char *color_string = arg_cnt >= 1 ? arg_strings[0] : NULL;
     const char *file_string  = arg_cnt == 2 ? arg_strings[1] : NULL;
@@ -1113,6 +2593,20 @@ process_args (unsigned int arg_cnt, char **arg_strings, char *attr, const struct
         color_string = config->color;
       }
 
+    process_color_string (color_string, attr, colors);
+    process_file_arg (file_string, file, stream);
+}
+
+static void
+process_color_string (const char *color_string, char *attr, const struct color **colors)
+{
+    char *p;
+    struct color_name *color_names[3] = {
+        NULL, /* foreground */
+        NULL, /* background */
+        NULL, /* sentinel value */
+    };
+
     if ((p = strchr (color_string, COLOR_SEP_CHAR)))
       {
         if (p == color_string)
@@ -1177,7 +2671,32 @@ process_args (unsigned int arg_cnt, char **arg_strings, char *attr, const struct
         assert (colors[FOREGROUND]->code != NULL);
       }
 
-    process_file_arg (file_string, file, stream);
+}
+
+/* --exec: streams without color of their own get the color string
+   argument, if any.  */
+static void
+process_exec_args (const char *color_string, const char **file, FILE **stream)
+{
+    unsigned int i;
+
+    if (clean || clean_all || normalize || field_colors)
+      {
+        if (exec_streams[0].color_string || exec_streams[1].color_string)
+          vfprintf_diag ("--stdout and --stderr switch have no meaning with --clean[-all]/--normalize/--field-colors");
+      }
+    else
+      for (i = 0; i < 2; i++)
+        {
+          struct exec_stream *exec_stream = &exec_streams[i];
+          const char *string = exec_stream->color_string ? exec_stream->color_string
+                             : color_string ? color_string : "none";
+          strcpy (exec_stream->attr, attr);
+          process_color_string (string, exec_stream->attr, exec_stream->colors);
+        }
+
+    *stream = stdin;
+    *file = exec_command;
 }
 
 static void
@@ -1213,10 +2732,388 @@ process_file_arg (const char *file_string, const char **file, FILE **stream)
         *file = "stdin";
       }
 
+#ifdef HAVE_DECOMPRESS
+    setup_decompress (*file, stream);
+#endif
+
     assert (*stream != NULL);
     assert (*file != NULL);
 }
 
+#ifdef HAVE_DECOMPRESS
+static void
+setup_decompress (const char *file, FILE **stream)
+{
+    unsigned char magic[MAX_MAGIC_CHARS];
+    struct decompress *dec;
+    struct stat sb;
+    off_t offset;
+    ssize_t len;
+    unsigned int i;
+    bool failed = false;
+    int fd, ret;
+
+    fd = fileno (*stream);
+
+    /* only regular files can be peeked at without consuming input  */
+    if (fstat (fd, &sb) == -1 || !S_ISREG (sb.st_mode))
+      return;
+    if ((offset = lseek (fd, 0, SEEK_CUR)) == -1)
+      return;
+    if ((len = pread (fd, magic, sizeof (magic), offset)) <= 0)
+      return;
+
+    for (i = 0; i < COUNT_OF (compressions, compressions[0]); i++)
+      if ((size_t)len >= compressions[i].magic_len
+       && memcmp (magic, compressions[i].magic, compressions[i].magic_len) == 0)
+        break;
+    if (i == COUNT_OF (compressions, compressions[0]))
+      return;
+
+    dec = xcalloc (1, sizeof (struct decompress));
+    dec->file = file;
+    dec->fd = fd;
+    dec->type = compressions[i].type;
+    dec->next_in = dec->in;
+
+    switch (dec->type)
+      {
+# ifdef HAVE_ZLIB
+        case COMPRESSION_GZIP:
+          failed = inflateInit2 (&dec->lib.zs, 15 + 16) != Z_OK; /* gzip header */
+          break;
+# endif
+# ifdef HAVE_LZMA
+        case COMPRESSION_XZ: {
+          const lzma_stream ls = LZMA_STREAM_INIT;
+          dec->lib.ls = ls;
+          failed = lzma_stream_decoder (&dec->lib.ls, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK;
+          break;
+        }
+# endif
+# ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+          failed = (dec->lib.zds = ZSTD_createDStream ()) == NULL;
+          break;
+# endif
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+    if (failed)
+      vfprintf_fail (formats[FMT_FILE], file, "cannot initialize decompression");
+
+    pthread_mutex_init (&dec->mutex, NULL);
+    pthread_cond_init (&dec->cond, NULL);
+
+# ifdef HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t io_funcs = { decompress_read, NULL, NULL, decompress_close };
+        *stream = fopencookie (dec, "r", io_funcs);
+    }
+# else
+    *stream = funopen (dec, decompress_read_bsd, NULL, NULL, decompress_close);
+# endif
+    if (!*stream)
+      vfprintf_fail (formats[FMT_FILE], file, strerror (errno));
+
+    /* fread() copies straight from the decompressed buffers  */
+    setvbuf (*stream, NULL, _IONBF, 0);
+
+    if ((ret = pthread_create (&dec->thread, NULL, decompress_thread, dec)) != 0)
+      vfprintf_fail (formats[FMT_FILE], file, strerror (ret));
+    STACK_FILE (*stream);
+}
+
+static void *
+decompress_thread (void *arg)
+{
+    struct decompress *dec = arg;
+
+    for (;;)
+      {
+        unsigned int slot;
+        size_t len;
+        bool done;
+
+        pthread_mutex_lock (&dec->mutex);
+        while (dec->filled == DECOMPRESS_BUFS && !dec->cancel)
+          pthread_cond_wait (&dec->cond, &dec->mutex);
+        if (dec->cancel)
+          {
+            pthread_mutex_unlock (&dec->mutex);
+            break;
+          }
+        slot = (dec->head + dec->filled) % DECOMPRESS_BUFS;
+        pthread_mutex_unlock (&dec->mutex);
+
+        len = decompress_fill (dec, dec->bufs[slot].data, DECOMPRESS_BUF_SIZE);
+        dec->bufs[slot].len = len;
+        done = dec->finished || dec->error;
+
+        pthread_mutex_lock (&dec->mutex);
+        if (len)
+          dec->filled++;
+        dec->done = done;
+        pthread_cond_signal (&dec->cond);
+        pthread_mutex_unlock (&dec->mutex);
+
+        if (done)
+          break;
+      }
+
+    return NULL;
+}
+
+static size_t
+decompress_fill (struct decompress *dec, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    while (len < size && !dec->finished && !dec->error)
+      {
+        enum decompress_status status;
+        size_t in_used, out_used;
+
+        if (dec->avail_in == 0 && !dec->in_eof && !decompress_input (dec))
+          break;
+        /* gzip: data following a member which does not start another
+           (padding of tar, garbage) is ignored as by gzip(1) */
+        if (dec->type == COMPRESSION_GZIP && dec->member_end && dec->avail_in
+         && (dec->next_in[0] != 0x1f || (dec->avail_in > 1 && dec->next_in[1] != 0x8b)))
+          {
+            vfprintf_diag (formats[FMT_FILE], dec->file, "trailing data after compressed data ignored");
+            dec->finished = true;
+            break;
+          }
+
+        status = decompress_step (dec, buf + len, size - len, &in_used, &out_used);
+        dec->next_in  += in_used;
+        dec->avail_in -= in_used;
+        len += out_used;
+
+        switch (status)
+          {
+            case DS_OK:
+              if (in_used)
+                dec->member_end = false;
+              else if (!out_used && dec->in_eof && !dec->avail_in)
+                {
+                  if (dec->member_end)
+                    dec->finished = true;
+                  else
+                    dec->error = "unexpected end of compressed data";
+                }
+              break;
+            case DS_END:
+              dec->member_end = true;
+              if (dec->in_eof && !dec->avail_in)
+                dec->finished = true;
+              break;
+            case DS_ERROR:
+              break;
+            default: /* never reached */
+              ABORT_TRACE ();
+          }
+      }
+
+    return len;
+}
+
+static bool
+decompress_input (struct decompress *dec)
+{
+    ssize_t ret;
+
+    do {
+        errno = 0;
+        ret = read (dec->fd, dec->in, sizeof (dec->in));
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1)
+      {
+        dec->error = strerror (errno);
+        return false;
+      }
+    dec->next_in  = dec->in;
+    dec->avail_in = ret;
+    if (ret == 0)
+      dec->in_eof = true;
+
+    return true;
+}
+
+static enum decompress_status
+decompress_step (struct decompress *dec, char *buf, size_t size, size_t *in_used, size_t *out_used)
+{
+    const char *const data_error = "invalid compressed data";
+
+    switch (dec->type)
+      {
+# ifdef HAVE_ZLIB
+        case COMPRESSION_GZIP: {
+          z_stream *zs = &dec->lib.zs;
+          int ret;
+          zs->next_in   = (Bytef *)dec->next_in;
+          zs->avail_in  = (uInt)dec->avail_in;
+          zs->next_out  = (Bytef *)buf;
+          zs->avail_out = (uInt)size;
+          ret = inflate (zs, Z_NO_FLUSH);
+          *in_used  = dec->avail_in - zs->avail_in;
+          *out_used = size - zs->avail_out;
+          switch (ret)
+            {
+              case Z_OK:
+              case Z_BUF_ERROR:
+                return DS_OK;
+              case Z_STREAM_END: /* concatenated members follow */
+                inflateReset (zs);
+                return DS_END;
+              default:
+                dec->error = zs->msg ? zs->msg : data_error;
+                return DS_ERROR;
+            }
+        }
+# endif
+# ifdef HAVE_LZMA
+        case COMPRESSION_XZ: {
+          lzma_stream *ls = &dec->lib.ls;
+          lzma_ret ret;
+          ls->next_in   = dec->next_in;
+          ls->avail_in  = dec->avail_in;
+          ls->next_out  = (uint8_t *)buf;
+          ls->avail_out = size;
+          ret = lzma_code (ls, dec->in_eof ? LZMA_FINISH : LZMA_RUN);
+          *in_used  = dec->avail_in - ls->avail_in;
+          *out_used = size - ls->avail_out;
+          switch (ret)
+            {
+              case LZMA_OK:
+              case LZMA_BUF_ERROR:
+                return DS_OK;
+              case LZMA_STREAM_END:
+                return DS_END;
+              default:
+                dec->error = data_error;
+                return DS_ERROR;
+            }
+        }
+# endif
+# ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD: {
+          ZSTD_inBuffer in;
+          ZSTD_outBuffer out;
+          size_t ret;
+          in.src   = dec->next_in;
+          in.size  = dec->avail_in;
+          in.pos   = 0;
+          out.dst  = buf;
+          out.size = size;
+          out.pos  = 0;
+          ret = ZSTD_decompressStream (dec->lib.zds, &out, &in);
+          *in_used  = in.pos;
+          *out_used = out.pos;
+          if (ZSTD_isError (ret))
+            {
+              dec->error = ZSTD_getErrorName (ret);
+              return DS_ERROR;
+            }
+          return ret == 0 ? DS_END : DS_OK;
+        }
+# endif
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+
+    return DS_ERROR;
+}
+
+static ssize_t
+decompress_read (void *cookie, char *buf, size_t size)
+{
+    struct decompress *dec = cookie;
+    size_t len;
+    unsigned int slot;
+
+    pthread_mutex_lock (&dec->mutex);
+    while (!dec->filled && !dec->done)
+      pthread_cond_wait (&dec->cond, &dec->mutex);
+    if (!dec->filled)
+      {
+        pthread_mutex_unlock (&dec->mutex);
+        /* failing here would drop what fread() has gathered so far */
+        if (dec->error)
+          decompress_error = dec->error;
+        return 0;
+      }
+    slot = dec->head;
+    pthread_mutex_unlock (&dec->mutex);
+
+    len = dec->bufs[slot].len - dec->pos;
+    if (len > size)
+      len = size;
+    memcpy (buf, dec->bufs[slot].data + dec->pos, len);
+    dec->pos += len;
+
+    if (dec->pos == dec->bufs[slot].len)
+      {
+        pthread_mutex_lock (&dec->mutex);
+        dec->head = (dec->head + 1) % DECOMPRESS_BUFS;
+        dec->filled--;
+        dec->pos = 0;
+        pthread_cond_signal (&dec->cond);
+        pthread_mutex_unlock (&dec->mutex);
+      }
+
+    return (ssize_t)len;
+}
+
+# ifndef HAVE_FOPENCOOKIE
+static int
+decompress_read_bsd (void *cookie, char *buf, int size)
+{
+    return (int)decompress_read (cookie, buf, (size_t)size);
+}
+# endif
+
+static int
+decompress_close (void *cookie)
+{
+    struct decompress *dec = cookie;
+
+    pthread_mutex_lock (&dec->mutex);
+    dec->cancel = true;
+    pthread_cond_signal (&dec->cond);
+    pthread_mutex_unlock (&dec->mutex);
+    pthread_join (dec->thread, NULL);
+
+    switch (dec->type)
+      {
+# ifdef HAVE_ZLIB
+        case COMPRESSION_GZIP:
+          inflateEnd (&dec->lib.zs);
+          break;
+# endif
+# ifdef HAVE_LZMA
+        case COMPRESSION_XZ:
+          lzma_end (&dec->lib.ls);
+          break;
+# endif
+# ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+          ZSTD_freeDStream (dec->lib.zds);
+          break;
+# endif
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+    pthread_mutex_destroy (&dec->mutex);
+    pthread_cond_destroy (&dec->cond);
+    free (dec);
+
+    return 0;
+}
+#endif
+
 static bool
 skip_path_colors (const char *color_string, const char *file_string, const struct stat *sb, const bool has_conf)
 {
@@ -1338,109 +3235,2221 @@ gather_color_names (const char *color_string, char *attr, struct color_name **co
 }
 
 static void
-read_print_stream (const char *attr, const struct color **colors, const char *file, FILE *stream)
+open_output (FILE *stream)
 {
-    char buf[BUF_SIZE + 1];
-    unsigned int flags = 0;
+    struct stat sb_in, sb_out;
+    bool regular_input;
+    int fd, flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    regular_input = fstat (fileno (stream), &sb_in) == 0 && S_ISREG (sb_in.st_mode);
+    if (regular_input && stat (output_file, &sb_out) == 0
+     && sb_in.st_dev == sb_out.st_dev && sb_in.st_ino == sb_out.st_ino)
+      vfprintf_fail (formats[FMT_FILE], output_file, "input file is output file");
+
+#ifdef O_DIRECT
+    /* --direct */
+    if (output_direct)
+      flags |= O_DIRECT;
+#endif
+    errno = 0;
+    fd = open (output_file, flags, 0666);
+#ifdef O_DIRECT
+    if (fd == -1 && errno == EINVAL && output_direct)
+      {
+        vfprintf_diag (formats[FMT_FILE], output_file, "direct I/O not supported, writing buffered");
+        output_direct = false;
+        errno = 0;
+        fd = open (output_file, flags & ~O_DIRECT, 0666);
+      }
+#endif
+    if (fd == -1)
+      vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
+    if (fd != STDOUT_FILENO)
+      {
+        if (dup2 (fd, STDOUT_FILENO) == -1)
+          vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
+        close (fd);
+      }
 
-    while (!feof (stream))
+    /* --preallocate: estimated from the input size  */
+    if (output_preallocate && regular_input && sb_in.st_size > 0)
       {
-        size_t bytes_read;
-        char *eol;
-        const char *line;
-        bytes_read = fread (buf, 1, BUF_SIZE, stream);
-        if (bytes_read != BUF_SIZE && ferror (stream))
-          vfprintf_fail (formats[FMT_ERROR], BUF_SIZE, "read");
-        buf[bytes_read] = '\0';
-        line = buf;
-        while ((eol = strpbrk (line, "\n\r")))
-          {
-            const bool has_text = (eol > line);
-            const char *p;
-            flags &= ~(CR|LF);
-            if (*eol == '\r')
-              {
-                flags |= CR;
-                if (*(eol + 1) == '\n')
-                  flags |= LF;
-              }
-            else if (*eol == '\n')
-              flags |= LF;
-            else /* never reached */
-              vfprintf_fail (formats[FMT_FILE], file, "unrecognized line ending");
-            p = eol + SKIP_LINE_ENDINGS (flags);
-            *eol = '\0';
-            print_line (attr, colors, line, flags,
-                        omit_color_empty ? has_text : true);
-            line = p;
-          }
-        if (feof (stream))
-          {
-            if (*line != '\0')
-              print_line (attr, colors, line, PARTIAL, true);
-          }
-        else if (*line != '\0')
-          {
-            char *p;
-            if ((clean || clean_all) && (p = strrchr (line, '\033')))
-              merge_print_line (line, p, stream);
-            else if (rainbow_fg || rainbow_bg)
-              print_line (attr, colors, line, PARTIAL, true);
-            else
-              print_line (attr, colors, line, 0, true);
-          }
+        const off_t size = (clean || clean_all || normalize)
+          ? sb_in.st_size
+          : sb_in.st_size + sb_in.st_size / OUTPUT_EXPANSION;
+        output_preallocated = posix_fallocate (STDOUT_FILENO, 0, size) == 0;
       }
 }
 
 static void
-merge_print_line (const char *line, const char *p, FILE *stream)
+close_output (void)
 {
-    char *buf = NULL;
-    char *merged_esc = NULL;
-    const char *esc = "";
-    const char char_restore = *p;
-
-    complete_part_line (p + 1, &buf, stream);
+    off_t size;
 
-    if (buf)
+#ifdef O_DIRECT
+    /* --direct: the last block written is not aligned */
+    if (output_direct)
       {
-        /* form escape sequence */
-        esc = merged_esc = str_concat (p, buf);
-        /* shorten partial line accordingly */
-        *(char *)p = '\0';
-        free (buf);
+        const int flags = fcntl (STDOUT_FILENO, F_GETFL);
+        if (flags != -1)
+          fcntl (STDOUT_FILENO, F_SETFL, flags & ~O_DIRECT);
       }
-
-#ifdef TEST_MERGE_PART_LINE
-    printf ("%s%s", line, esc);
-    fflush (stdout);
-    _exit (EXIT_SUCCESS);
-#else
-    print_clean (line);
-    *(char *)p = char_restore;
-    print_clean (esc);
-    free (merged_esc);
 #endif
+    if (fflush (stdout) == EOF)
+      vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
+    /* --preallocate: discard space allocated beyond the output */
+    if (output_preallocated
+     && ((size = lseek (STDOUT_FILENO, 0, SEEK_CUR)) == -1 || ftruncate (STDOUT_FILENO, size) == -1))
+      vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
+    /* --fsync */
+    if (output_fsync && fsync (STDOUT_FILENO) == -1)
+      vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
 }
 
+/* --in-place: text is compacted towards the start of the mapping, as
+   cleaned text is never longer.  */
+/* The file is mapped read-only and cleaned a chunk at a time into a
+   buffer, which is written to the file itself below the text yet to be
+   read, or to the file replacing it.  Pages read are dropped, so that
+   the memory in use is bounded by the chunk size, not the file size.  */
 static void
-complete_part_line (const char *p, char **buf, FILE *stream)
+clean_in_place (const char *file)
 {
-    bool got_next_char = false, read_from_stream;
-    char ch;
-    size_t i = 0, size;
+    struct stat sb;
+    char *map, *buf = NULL, *tmp = NULL;
+    size_t offset = 0, dropped = 0, buf_size = 0;
+    const size_t page = sysconf (_SC_PAGESIZE);
+    off_t written = 0;
+    int fd, out_fd;
+    bool ok = true;
 
-    if (get_next_char (&ch, &p, stream, &read_from_stream))
+    errno = 0;
+    if (stat (file, &sb) == -1)
+      vfprintf_fail (formats[FMT_FILE], file, strerror (errno));
+    if (!S_ISREG (sb.st_mode))
+      vfprintf_fail (formats[FMT_TYPE], file, "not a regular file", get_file_type (sb.st_mode));
+    if ((fd = open (file, in_place == IN_PLACE_TRUNCATE ? O_RDWR : O_RDONLY)) == -1 || fstat (fd, &sb) == -1)
+      vfprintf_fail (formats[FMT_FILE], file, strerror (errno));
+    if (sb.st_size == 0)
       {
-        if (ch == '[')
+        close (fd);
+        return;
+      }
+    if ((map = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      vfprintf_fail (formats[FMT_FILE], file, strerror (errno));
+    madvise (map, sb.st_size, MADV_SEQUENTIAL);
+    out_fd = fd;
+    if (in_place == IN_PLACE_RENAME && (out_fd = open_renamed (file, &tmp)) == -1)
+      vfprintf_fail (formats[FMT_FILE], file, strerror (errno));
+
+    while (ok && offset < (size_t)sb.st_size)
+      {
+        const size_t end = next_chunk (map, offset, sb.st_size, IN_PLACE_CHUNK_SIZE);
+        size_t len;
+        if (end - offset + 1 > buf_size)
           {
-            if (read_from_stream)
-              save_char (ch, buf, &i, &size);
+            buf_size = end - offset + 1;
+            buf = xrealloc (buf, buf_size);
+          }
+        len = clean_copy (buf, map + offset, map + end) - buf;
+        ok = write_text_at (out_fd, buf, len, written);
+        written += len;
+        offset = end;
+        if (offset - offset % page > dropped)
+          {
+            madvise (map + dropped, offset - offset % page - dropped, MADV_DONTNEED);
+            dropped = offset - offset % page;
+          }
+      }
+    free (buf);
+
+    if (in_place == IN_PLACE_RENAME)
+      ok = close_renamed (file, &sb, tmp, out_fd, ok);
+    if (!ok
+     || munmap (map, sb.st_size) == -1
+     || (in_place == IN_PLACE_TRUNCATE && written < sb.st_size && ftruncate (fd, written) == -1))
+      vfprintf_fail (formats[FMT_FILE], file, strerror (errno));
+    close (fd);
+}
+
+/* Chunks end with a newline, the last one excepted; returns the end of
+   the chunk starting at offset.  */
+static size_t
+next_chunk (const char *map, size_t offset, size_t size, size_t chunk_size)
+{
+    const char *eol;
+
+    if (size - offset <= chunk_size || !(eol = memchr (map + offset + chunk_size, '\n', size - offset - chunk_size)))
+      return size;
+    return eol + 1 - map;
+}
+
+/* Cleans [start, end) into dst, which has room for end - start + 1
+   bytes, and returns the end of the cleaned text.  Sequences do not
+   span line endings, therefore the text following the last one is
+   cleaned in a terminated copy, so that no sequence is matched beyond
+   end.  */
+static char *
+clean_copy (char *dst, const char *start, const char *end)
+{
+    const char *eol;
+
+    for (eol = end; eol > start && *(eol - 1) != '\n' && *(eol - 1) != '\r'; eol--)
+      ;
+    dst = clean_text (dst, start, eol);
+    if (eol < end)
+      {
+        const size_t len = end - eol;
+        memcpy (dst, eol, len);
+        dst[len] = '\0';
+        dst = clean_text (dst, dst, dst + len);
+      }
+    return dst;
+}
+
+/* --in-place=rename: the file (a symbolic link's target) is replaced
+   atomically, with mode and ownership kept.  Called by the --recursive
+   workers as well, hence nothing is stacked and errors are left to the
+   caller (with errno set).  Creates the file next to the one to be
+   replaced; returns its descriptor and path, which close_renamed()
+   releases.  */
+static int
+open_renamed (const char *file, char **tmp)
+{
+    char *path;
+    int fd;
+
+    if (!(path = realpath (file, NULL)))
+      return -1;
+    *tmp = str_concat (path, RENAME_SUFFIX);
+    free (path);
+    if ((fd = mkstemp (*tmp)) == -1)
+      {
+        const int saved_errno = errno;
+        free (*tmp);
+        errno = saved_errno;
+      }
+    return fd;
+}
+
+/* The file written is renamed over the one replaced if ok, and removed
+   otherwise.  */
+static bool
+close_renamed (const char *file, const struct stat *sb, char *tmp, int fd, bool ok)
+{
+    char *path = xstrdup (tmp);
+
+    path[strlen (path) - strlen (RENAME_SUFFIX)] = '\0';
+    /* Unprivileged, a file of someone else ends up owned by the user.
+       Changing the owner clears set-user-ID and set-group-ID bits, hence
+       the mode is set afterwards.  */
+    if (ok && fchown (fd, sb->st_uid, sb->st_gid) == -1)
+      {
+        if (errno == EPERM)
+          vfprintf_diag (formats[FMT_FILE], file, "owner and group not preserved");
+        else
+          ok = false;
+      }
+    ok = ok && fchmod (fd, sb->st_mode & 07777) == 0 && fsync (fd) == 0;
+    /* the descriptor is released by close() even if it fails */
+    if (!ok)
+      {
+        const int saved_errno = errno;
+        close (fd);
+        errno = saved_errno;
+      }
+    else
+      ok = close (fd) == 0 && rename (tmp, path) == 0;
+    if (!ok)
+      {
+        const int saved_errno = errno;
+        unlink (tmp);
+        free (tmp);
+        free (path);
+        errno = saved_errno;
+        return false;
+      }
+    free (tmp);
+    free (path);
+    return true;
+}
+
+static bool
+write_text_at (int fd, const char *text, size_t len, off_t offset)
+{
+    size_t written = 0;
+
+    while (written < len)
+      {
+        const ssize_t ret = pwrite (fd, text + written, len - written, offset + (off_t)written);
+        if (ret == -1 && errno == EINTR)
+          continue;
+        if (ret == 0)
+          errno = ENOSPC;
+        if (ret <= 0)
+          return false;
+        written += ret;
+      }
+    return true;
+}
+
+/* Text in between valid sequences of [src, end) is moved to dst (which
+   is not beyond src, or a buffer of its own).  A sequence must not continue beyond end, which
+   holds if the text ends with a line ending or NUL.  Returns the end of
+   the text moved.  */
+static char *
+clean_text (char *dst, const char *src, const char *end)
+{
+    const char *text = src, *p = src;
+    const char *esc;
+
+    while ((esc = memchr (p, '\033', end - p)))
+      {
+        const char *seq_end = match_esc (esc);
+        if (seq_end)
+          {
+            memmove (dst, text, esc - text);
+            dst += esc - text;
+            text = p = seq_end + 1;
+          }
+        else
+          p = esc + 1;
+      }
+    memmove (dst, text, end - text);
+    return dst + (end - text);
+}
+
+/* --recursive: the calling thread is a worker as well.  Entries which
+   fail are diagnosed and skipped; returns false if there were any.  */
+static bool
+run_recursive (void)
+{
+    pthread_t threads[WALK_WORKERS_MAX];
+    unsigned int ids[WALK_WORKERS_MAX];
+    struct stat sb;
+    long cpus;
+    unsigned int i;
+
+    if (stat (recursive_dir, &sb) == -1)
+      vfprintf_fail (formats[FMT_FILE], recursive_dir, strerror (errno));
+    if (!S_ISDIR (sb.st_mode))
+      vfprintf_fail (formats[FMT_TYPE], recursive_dir, "not a directory", get_file_type (sb.st_mode));
+    if (output_file)
+      {
+        char *src, *dst;
+        size_t len;
+        const bool created = mkdir (output_file, (sb.st_mode & 07777) | S_IRWXU) == 0;
+        if (!created && errno != EEXIST)
+          vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
+        if (!(src = realpath (recursive_dir, NULL)))
+          vfprintf_fail (formats[FMT_FILE], recursive_dir, strerror (errno));
+        if (!(dst = realpath (output_file, NULL)))
+          vfprintf_fail (formats[FMT_FILE], output_file, strerror (errno));
+        len = strlen (src);
+        if (strneq (src, dst, len) && (dst[len] == '/' || dst[len] == '\0' || src[len - 1] == '/'))
+          {
+            if (created)
+              rmdir (output_file);
+            vfprintf_fail (formats[FMT_FILE], output_file, "output directory is within input directory");
+          }
+        free (src);
+        free (dst);
+      }
+
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    walk.count = cpus < 1 ? 1 : cpus > WALK_WORKERS_MAX ? WALK_WORKERS_MAX : (unsigned int)cpus;
+    pthread_mutex_init (&walk.mutex, NULL);
+    pthread_cond_init (&walk.cond, NULL);
+    for (i = 0; i < walk.count; i++)
+      pthread_mutex_init (&walk.deques[i].mutex, NULL);
+
+    walk_push (0, TASK_DIR, xstrdup (recursive_dir), NULL, 0);
+    walk.running = true;
+    for (i = 0; i < walk.count; i++)
+      {
+        int ret;
+        ids[i] = i;
+        if (i > 0 && (ret = pthread_create (&threads[i], NULL, walk_worker, &ids[i])) != 0)
+          vfprintf_fail (formats[FMT_GENERIC], strerror (ret));
+      }
+    walk_worker (&ids[0]);
+    for (i = 1; i < walk.count; i++)
+      pthread_join (threads[i], NULL);
+    walk.running = false;
+
+    for (i = 0; i < walk.count; i++)
+      {
+        pthread_mutex_destroy (&walk.deques[i].mutex);
+        free (walk.deques[i].tasks);
+      }
+    pthread_cond_destroy (&walk.cond);
+    pthread_mutex_destroy (&walk.mutex);
+    free (walk.links);
+
+    return !walk.failed;
+}
+
+static void *
+walk_worker (void *arg)
+{
+    const unsigned int self = *(const unsigned int *)arg;
+    struct walk_task task;
+
+    while (walk_take (self, &task))
+      {
+        switch (task.type)
+          {
+            case TASK_DIR:
+              walk_dir (self, task.path);
+              free (task.path);
+              break;
+            case TASK_FILE: /* path is taken over */
+              walk_file (self, task.path);
+              break;
+            case TASK_CHUNK:
+              walk_chunk (task.file, task.chunk);
+              break;
+            default: /* never reached */
+              ABORT_TRACE ();
+          }
+        walk_done ();
+      }
+    return NULL;
+}
+
+/* Own tasks are taken from the back (the most recent, whose data is
+   likely cached), others' from the front.  Returns false once all
+   tasks are done.  */
+static bool
+walk_take (unsigned int self, struct walk_task *task)
+{
+    for (;;)
+      {
+        unsigned int i;
+        bool done;
+        for (i = 0; i < walk.count; i++)
+          {
+            struct walk_deque *deque = &walk.deques[(self + i) % walk.count];
+            bool taken = false;
+            pthread_mutex_lock (&deque->mutex);
+            if (deque->head < deque->tail)
+              {
+                *task = i == 0 ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+                if (deque->head == deque->tail)
+                  deque->head = deque->tail = 0;
+                taken = true;
+              }
+            pthread_mutex_unlock (&deque->mutex);
+            if (taken)
+              {
+                pthread_mutex_lock (&walk.mutex);
+                walk.queued--;
+                pthread_mutex_unlock (&walk.mutex);
+                return true;
+              }
+          }
+        pthread_mutex_lock (&walk.mutex);
+        while (!walk.queued && walk.pending)
+          pthread_cond_wait (&walk.cond, &walk.mutex);
+        done = !walk.pending;
+        pthread_mutex_unlock (&walk.mutex);
+        if (done)
+          return false;
+      }
+}
+
+static void
+walk_push (unsigned int self, enum walk_task_type type, char *path, struct walk_file *file, size_t chunk)
+{
+    struct walk_deque *deque = &walk.deques[self];
+    struct walk_task *task;
+
+    pthread_mutex_lock (&deque->mutex);
+    if (deque->tail == deque->size)
+      {
+        if (deque->head > 0)
+          {
+            memmove (deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof (struct walk_task));
+            deque->tail -= deque->head;
+            deque->head = 0;
+          }
+        else
+          {
+            deque->size = deque->size ? deque->size * 2 : 64;
+            deque->tasks = xrealloc (deque->tasks, deque->size * sizeof (struct walk_task));
+          }
+      }
+    task = &deque->tasks[deque->tail++];
+    task->type = type;
+    task->path = path;
+    task->file = file;
+    task->chunk = chunk;
+    pthread_mutex_unlock (&deque->mutex);
+
+    pthread_mutex_lock (&walk.mutex);
+    walk.queued++;
+    walk.pending++;
+    pthread_cond_signal (&walk.cond);
+    pthread_mutex_unlock (&walk.mutex);
+}
+
+static void
+walk_done (void)
+{
+    pthread_mutex_lock (&walk.mutex);
+    if (--walk.pending == 0)
+      pthread_cond_broadcast (&walk.cond);
+    pthread_mutex_unlock (&walk.mutex);
+}
+
+/* Workers must not exit, as cleanup() would release what the others
+   still use.  */
+static void
+walk_fail (const char *path)
+{
+    vfprintf_diag (formats[FMT_FILE], path, strerror (errno));
+    pthread_mutex_lock (&walk.mutex);
+    walk.failed = true;
+    pthread_mutex_unlock (&walk.mutex);
+}
+
+/* Entries are queued as found; the directory of the mirrored tree is
+   created before any of its files is written.  */
+static void
+walk_dir (unsigned int self, const char *path)
+{
+    const size_t len = strlen (path);
+    DIR *dir;
+    struct dirent *entry;
+
+    if (!(dir = opendir (path)))
+      {
+        walk_fail (path);
+        return;
+      }
+    if (output_file)
+      {
+        struct stat sb;
+        char *mirror = str_concat (output_file, path + strlen (recursive_dir));
+        int ret = fstat (dirfd (dir), &sb);
+        if (ret == 0 && (ret = mkdir (mirror, (sb.st_mode & 07777) | S_IRWXU)) == -1 && errno == EEXIST)
+          {
+            /* an existing entry has to be a directory */
+            ret = stat (mirror, &sb);
+            if (ret == 0 && !S_ISDIR (sb.st_mode))
+              {
+                errno = ENOTDIR;
+                ret = -1;
+              }
+          }
+        /* nowhere to write the entries to */
+        if (ret == -1)
+          {
+            walk_fail (mirror);
+            free (mirror);
+            closedir (dir);
+            return;
+          }
+        free (mirror);
+      }
+    errno = 0;
+    while ((entry = readdir (dir)))
+      {
+        struct stat sb;
+        char *child;
+        if (streq (entry->d_name, ".") || streq (entry->d_name, ".."))
+          continue;
+        child = xmalloc (len + 1 + strlen (entry->d_name) + 1);
+        sprintf (child, "%s/%s", path, entry->d_name);
+        if (lstat (child, &sb) == -1)
+          {
+            walk_fail (child);
+            free (child);
+          }
+        else if (S_ISDIR (sb.st_mode))
+          walk_push (self, TASK_DIR, child, NULL, 0);
+        else if (VALID_FILE_TYPE (sb.st_mode) && !(S_ISLNK (sb.st_mode) && in_place))
+          walk_push (self, TASK_FILE, child, NULL, 0);
+        else
+          {
+            vfprintf_diag (formats[FMT_TYPE], child, "skipped", get_file_type (sb.st_mode));
+            free (child);
+          }
+        errno = 0;
+      }
+    if (errno)
+      walk_fail (path);
+    closedir (dir);
+}
+
+/* Symbolic links are followed for a mirrored tree only; files linked
+   more than once are cleaned in place once.  A large file is split
+   into chunks, all but the first of which are queued.  */
+static void
+walk_file (unsigned int self, char *path)
+{
+    struct walk_file *file;
+    struct stat sb;
+    char *map = NULL;
+    int fd;
+    size_t i;
+
+    errno = 0;
+    if (stat (path, &sb) == -1 || !S_ISREG (sb.st_mode))
+      {
+        if (errno)
+          walk_fail (path);
+        else
+          vfprintf_diag (formats[FMT_TYPE], path, "skipped", get_file_type (sb.st_mode));
+        free (path);
+        return;
+      }
+    if (in_place && sb.st_nlink > 1)
+      {
+        bool seen = false;
+        pthread_mutex_lock (&walk.mutex);
+        for (i = 0; i < walk.links_count && !seen; i++)
+          seen = walk.links[i].dev == sb.st_dev && walk.links[i].ino == sb.st_ino;
+        if (!seen)
+          {
+            if (walk.links_count == walk.links_size)
+              {
+                walk.links_size = walk.links_size ? walk.links_size * 2 : 16;
+                walk.links = xrealloc (walk.links, walk.links_size * sizeof (*walk.links));
+              }
+            walk.links[walk.links_count].dev = sb.st_dev;
+            walk.links[walk.links_count].ino = sb.st_ino;
+            walk.links_count++;
+          }
+        pthread_mutex_unlock (&walk.mutex);
+        if (seen)
+          {
+            free (path);
+            return;
+          }
+      }
+
+    if ((fd = open (path, in_place == IN_PLACE_TRUNCATE ? O_RDWR : O_RDONLY)) == -1
+     || (sb.st_size && (map = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+      {
+        walk_fail (path);
+        if (fd != -1)
+          close (fd);
+        free (path);
+        return;
+      }
+
+    file = xmalloc (sizeof (struct walk_file));
+    file->path = path;
+    file->sb = sb;
+    file->fd = fd;
+    file->map = map;
+    file->out_fd = fd;
+    file->out_path = NULL;
+    if (output_file)
+      {
+        file->out_path = str_concat (output_file, path + strlen (recursive_dir));
+        file->out_fd = open (file->out_path, O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode & 07777);
+      }
+    else if (in_place == IN_PLACE_RENAME)
+      file->out_fd = open_renamed (path, &file->out_path);
+    if (file->out_fd == -1)
+      {
+        walk_fail (output_file ? file->out_path : path);
+        if (output_file)
+          free (file->out_path);
+        if (map && munmap (map, sb.st_size) == -1)
+          walk_fail (path);
+        close (fd);
+        free (path);
+        free (file);
+        return;
+      }
+
+    file->starts = xmalloc ((sb.st_size / WALK_CHUNK_SIZE + 2) * sizeof (size_t));
+    file->chunks = 0;
+    file->starts[0] = 0;
+    if (sb.st_size)
+      {
+        madvise (file->map, sb.st_size, MADV_SEQUENTIAL);
+        do
+          {
+            file->starts[file->chunks + 1] = next_chunk (map, file->starts[file->chunks], sb.st_size, WALK_CHUNK_SIZE);
+            file->chunks++;
+          }
+        while (file->starts[file->chunks] < (size_t)sb.st_size);
+      }
+    file->texts = xcalloc (file->chunks + 1, sizeof (char *));
+    file->lens = xmalloc ((file->chunks + 1) * sizeof (size_t));
+    file->next = 0;
+    file->writing = false;
+    file->written = 0;
+    file->error = 0;
+    pthread_mutex_init (&file->mutex, NULL);
+
+    if (!file->chunks)
+      {
+        walk_join (file);
+        return;
+      }
+    for (i = file->chunks - 1; i > 0; i--)
+      walk_push (self, TASK_CHUNK, NULL, file, i);
+    walk_chunk (file, 0);
+}
+
+static void
+walk_chunk (struct walk_file *file, size_t chunk)
+{
+    const char *const start = file->map + file->starts[chunk];
+    const char *const end = file->map + file->starts[chunk + 1];
+    const size_t page = sysconf (_SC_PAGESIZE);
+    const size_t first = (file->starts[chunk] + page - 1) / page * page;
+    const size_t last = file->starts[chunk + 1] / page * page;
+    char *text = xmalloc (end - start + 1);
+    const size_t len = clean_copy (text, start, end) - text;
+    bool joined = false;
+
+    /* pages read are dropped, those shared with the chunks around kept */
+    if (last > first)
+      madvise (file->map + first, last - first, MADV_DONTNEED);
+
+    pthread_mutex_lock (&file->mutex);
+    file->texts[chunk] = text;
+    file->lens[chunk] = len;
+    if (!file->writing)
+      {
+        file->writing = true;
+        while (file->next < file->chunks && file->texts[file->next])
+          {
+            char *const next_text = file->texts[file->next];
+            const size_t next_len = file->lens[file->next];
+            pthread_mutex_unlock (&file->mutex);
+            /* written at or below the chunk, whose text has been read */
+            if (!file->error && !write_text_at (file->out_fd, next_text, next_len, file->written))
+              file->error = errno;
+            file->written += next_len;
+            free (next_text);
+            pthread_mutex_lock (&file->mutex);
+            file->texts[file->next++] = NULL;
+          }
+        file->writing = false;
+        joined = file->next == file->chunks;
+      }
+    pthread_mutex_unlock (&file->mutex);
+    if (joined)
+      walk_join (file);
+}
+
+/* The output is completed, and the file released.  */
+static void
+walk_join (struct walk_file *file)
+{
+    if (output_file)
+      {
+        if (file->error)
+          {
+            close (file->out_fd);
+            errno = file->error;
+            walk_fail (file->out_path);
+          }
+        else if (close (file->out_fd) == -1)
+          walk_fail (file->out_path);
+        free (file->out_path);
+      }
+    else if (in_place == IN_PLACE_RENAME)
+      {
+        errno = file->error;
+        if (!close_renamed (file->path, &file->sb, file->out_path, file->out_fd, !file->error))
+          walk_fail (file->path);
+      }
+    else if (file->error)
+      {
+        errno = file->error;
+        walk_fail (file->path);
+      }
+    else if (file->written < file->sb.st_size && ftruncate (file->fd, file->written) == -1)
+      walk_fail (file->path);
+    if (file->map && munmap (file->map, file->sb.st_size) == -1)
+      walk_fail (file->path);
+    close (file->fd);
+    pthread_mutex_destroy (&file->mutex);
+    free (file->starts);
+    free (file->texts);
+    free (file->lens);
+    free (file->path);
+    free (file);
+}
+
+/* --tee: the file gets a copy of the output with escape sequences
+   removed, written through its own stdio buffer.  */
+static void
+open_tee (FILE *stream)
+{
+    struct stat sb_in, sb_tee;
+
+    if (fstat (fileno (stream), &sb_in) == 0 && S_ISREG (sb_in.st_mode) && stat (tee_file, &sb_tee) == 0
+     && sb_in.st_dev == sb_tee.st_dev && sb_in.st_ino == sb_tee.st_ino)
+      vfprintf_fail (formats[FMT_FILE], tee_file, "input file is tee file");
+    if (!(tee_stream = fopen (tee_file, "w")))
+      vfprintf_fail (formats[FMT_FILE], tee_file, strerror (errno));
+}
+
+static void
+close_tee (void)
+{
+    /* partial sequence at end of input */
+    tee_write (tee_pending, tee_pending_len);
+    if (fclose (tee_stream) == EOF)
+      vfprintf_fail (formats[FMT_FILE], tee_file, strerror (errno));
+    tee_stream = NULL;
+}
+
+/* A sequence which may be continued by the next part of a line
+   spanning several buffers is held back until then.  */
+static void
+tee_line (const char *line, unsigned int flags)
+{
+    char *merged = NULL;
+    const char *text = line, *p, *esc;
+
+    if (tee_pending_len)
+      {
+        text = merged = str_concat (tee_pending, line);
+        tee_pending_len = 0;
+      }
+    p = text;
+    while ((esc = strchr (p, '\033')))
+      {
+        const char *end;
+        const enum esc_state state = scan_esc (esc, &end);
+        if (state > ES_REJECT && (clean_all_seqs & ES_SEQ (state)))
+          {
+            tee_write (text, esc - text);
+            text = p = end + 1;
+          }
+        /* cut by the end of the buffer */
+        else if (state == ES_INCOMPLETE && *end == '\0' && (flags & PARTIAL) && (size_t)(end - esc) < sizeof (tee_pending))
+          {
+            tee_write (text, esc - text);
+            tee_pending_len = strlen (esc);
+            memcpy (tee_pending, esc, tee_pending_len + 1);
+            text = "";
+            break;
+          }
+        else
+          p = esc + 1;
+      }
+    tee_write (text, strlen (text));
+    if (flags & CR)
+      tee_write ("\r", 1);
+    if (flags & LF)
+      tee_write ("\n", 1);
+    free (merged);
+}
+
+static void
+tee_write (const char *p, size_t len)
+{
+    if (len && fwrite (p, 1, len, tee_stream) != len)
+      vfprintf_fail (formats[FMT_FILE], tee_file, strerror (errno));
+}
+
+static void
+open_html (void)
+{
+    const char *const header =
+      "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"UTF-8\">\n<title>colorize</title>\n</head>\n<body>\n<pre>\n";
+
+    html_classes['<'] = HC_LT;
+    html_classes['>'] = HC_GT;
+    html_classes['&'] = HC_AMP;
+    html_classes['\033'] = HC_ESC;
+
+    html_put (header, strlen (header));
+}
+
+/* --html, --trace-latency, --max-fps: stdio hands its buffer to the
+   cookie functions, which write to the stdout descriptor through
+   write_out().  */
+static void
+open_out (void)
+{
+#ifdef HAVE_FOPENCOOKIE
+    {
+        cookie_io_functions_t io_funcs = { NULL, out_cookie_write, NULL, out_cookie_close };
+        out = fopencookie (NULL, "w", io_funcs);
+    }
+#else
+    out = funopen (NULL, NULL, out_cookie_write_bsd, NULL, out_cookie_close);
+#endif
+    if (!out)
+      vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+}
+
+static void
+close_out (void)
+{
+    if (fclose (out) == EOF)
+      vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+    out = stdout;
+
+    /* --max-fps: last frame right away */
+    if (frame_rate)
+      {
+        frame_show ();
+        free (frame.buf);
+      }
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t
+out_cookie_write (void *cookie, const char *buf, size_t size)
+{
+    bool ok;
+
+    UNUSED (cookie);
+    if (html)
+      {
+        html_convert (buf, size);
+        ok = html_flush ();
+      }
+    else
+      ok = write_out (buf, size);
+    if (trace_latency)
+      trace_written (size);
+    return ok ? (ssize_t)size : -1;
+}
+#else
+static int
+out_cookie_write_bsd (void *cookie, const char *buf, int size)
+{
+    bool ok;
+
+    UNUSED (cookie);
+    if (html)
+      {
+        html_convert (buf, (size_t)size);
+        ok = html_flush ();
+      }
+    else
+      ok = write_out (buf, (size_t)size);
+    if (trace_latency)
+      trace_written ((size_t)size);
+    return ok ? size : -1;
+}
+#endif
+
+static int
+out_cookie_close (void *cookie)
+{
+    const char *const footer = "</pre>\n</body>\n</html>\n";
+
+    UNUSED (cookie);
+    if (!html)
+      return 0;
+
+    /* partial sequence at end of output is dropped */
+    html_conv.esc_len = 0;
+    if (html_conv.span_open)
+      html_put ("</span>", 7);
+    html_put (footer, strlen (footer));
+    return html_flush () ? 0 : EOF;
+}
+
+static bool
+write_out (const char *buf, size_t len)
+{
+    /* --max-fps */
+    if (frame_rate)
+      {
+        frame_add (buf, len);
+        return true;
+      }
+    return write_all (buf, len);
+}
+
+static bool
+write_all (const char *buf, size_t len)
+{
+    struct timespec start;
+    size_t written = 0;
+    bool ok = true;
+
+    if (trace_latency)
+      clock_gettime (CLOCK_MONOTONIC, &start);
+    while (written < len)
+      {
+        const ssize_t ret = write (STDOUT_FILENO, buf + written, len - written);
+        if (ret == -1 && errno == EINTR)
+          continue;
+        if (ret <= 0)
+          {
+            ok = false;
+            break;
+          }
+        written += ret;
+      }
+    if (trace_latency)
+      {
+        clock_gettime (CLOCK_MONOTONIC, &trace.last_write);
+        hist_add (&trace.write_wait, &start, &trace.last_write);
+      }
+    return ok;
+}
+
+/* Text is scanned for bytes to be replaced through a table; runs in
+   between are copied as they are.  */
+static void
+html_convert (const char *p, size_t n)
+{
+    /* partial sequence of the previous write */
+    while (html_conv.esc_len && n)
+      {
+        const size_t len = html_conv.esc_len;
+        const size_t take = n < HTML_SEQ_MAX - len ? n : HTML_SEQ_MAX - len;
+        size_t used;
+        memcpy (html_conv.esc + len, p, take);
+        if ((used = html_esc (html_conv.esc, len + take)) == 0)
+          {
+            html_conv.esc_len += take;
+            return;
+          }
+        html_conv.esc_len = 0;
+        if (used >= len)
+          {
+            p += used - len;
+            n -= used - len;
+          }
+        /* stray ESC: remaining bytes are text */
+        else
+          {
+            char rest[HTML_SEQ_MAX];
+            memcpy (rest, html_conv.esc + used, len - used);
+            html_convert (rest, len - used);
+          }
+      }
+
+    while (n)
+      {
+        size_t i = 0, used;
+        while (i < n && html_classes[(unsigned char)p[i]] == HC_TEXT)
+          i++;
+        if (i)
+          {
+            html_sync ();
+            html_put (p, i);
+            p += i;
+            n -= i;
+            continue;
+          }
+        switch (html_classes[(unsigned char)*p])
+          {
+            case HC_LT:
+              html_sync ();
+              html_put ("&lt;", 4);
+              used = 1;
+              break;
+            case HC_GT:
+              html_sync ();
+              html_put ("&gt;", 4);
+              used = 1;
+              break;
+            case HC_AMP:
+              html_sync ();
+              html_put ("&amp;", 5);
+              used = 1;
+              break;
+            case HC_ESC:
+              if ((used = html_esc (p, n)) == 0)
+                {
+                  memcpy (html_conv.esc, p, n);
+                  html_conv.esc_len = n;
+                  return;
+                }
+              break;
+            default: /* never reached */
+              ABORT_TRACE ();
+          }
+        p += used;
+        n -= used;
+      }
+}
+
+/* Return the length of the sequence at p (SGR sequences are applied,
+   others dropped), 1 for a stray ESC which is dropped, or 0 if the
+   sequence may be completed by the next write.  */
+static size_t
+html_esc (const char *p, size_t avail)
+{
+    char seq[HTML_SEQ_MAX + 1];
+    const size_t len = avail < HTML_SEQ_MAX ? avail : HTML_SEQ_MAX;
+    const char *end;
+    enum esc_state state;
+
+    memcpy (seq, p, len);
+    seq[len] = '\0';
+    state = scan_esc (seq, &end);
+    if (state == ES_INCOMPLETE && len < HTML_SEQ_MAX && strlen (seq) == len)
+      return 0;
+    if (state > ES_REJECT)
+      {
+        if (state == ES_SGR_END)
+          apply_sgr (seq + 2, end, &html_conv.wanted);
+        return end - seq + 1;
+      }
+    return 1;
+}
+
+/* Spans are changed only when text follows, so that redundant changes
+   collapse.  */
+static void
+html_sync (void)
+{
+    const struct sgr_state *want = &html_conv.wanted, *have = &html_conv.emitted;
+    char style[256];
+    size_t len;
+
+    if (want->attrs == have->attrs
+     && sgr_color_equal (&want->fg, &have->fg) && sgr_color_equal (&want->bg, &have->bg))
+      return;
+    if (html_conv.span_open)
+      html_put ("</span>", 7);
+    html_conv.emitted = *want;
+    if ((len = html_style (style, want)))
+      {
+        html_put ("<span style=\"", 13);
+        html_put (style, len);
+        html_put ("\">", 2);
+      }
+    html_conv.span_open = (len != 0);
+}
+
+/* Styles are assembled without sprintf(), as they are emitted for
+   nearly every colored line.  */
+#define STYLE_APPEND(str) (memcpy (style + len, str, sizeof (str) - 1), len += sizeof (str) - 1)
+
+static size_t
+html_style (char *style, const struct sgr_state *state)
+{
+    size_t len = 0;
+
+    if (state->attrs & (1 << 1))
+      STYLE_APPEND ("font-weight:bold;");
+    if (state->attrs & (1 << 2))
+      STYLE_APPEND ("opacity:0.6;");
+    if (state->attrs & (1 << 3))
+      STYLE_APPEND ("font-style:italic;");
+    if ((state->attrs & (1 << 4)) && (state->attrs & (1 << 9)))
+      STYLE_APPEND ("text-decoration:underline line-through;");
+    else if (state->attrs & (1 << 4))
+      STYLE_APPEND ("text-decoration:underline;");
+    else if (state->attrs & (1 << 9))
+      STYLE_APPEND ("text-decoration:line-through;");
+    if (state->attrs & (1 << 7))
+      STYLE_APPEND ("filter:invert(100%);");
+    if (state->attrs & (1 << 8))
+      STYLE_APPEND ("visibility:hidden;");
+    if (state->fg.type != SGR_COLOR_DEFAULT)
+      {
+        STYLE_APPEND ("color:");
+        len += html_color (style + len, &state->fg);
+      }
+    if (state->bg.type != SGR_COLOR_DEFAULT)
+      {
+        STYLE_APPEND ("background-color:");
+        len += html_color (style + len, &state->bg);
+      }
+    return len;
+}
+
+#undef STYLE_APPEND
+
+static size_t
+html_color (char *style, const struct sgr_color *color)
+{
+    /* VGA palette: normal (0-7) and bright (8-15) colors */
+    static const unsigned long palette[16] = {
+        0x000000, 0xaa0000, 0x00aa00, 0xaa5500, 0x0000aa, 0xaa00aa, 0x00aaaa, 0xaaaaaa,
+        0x555555, 0xff5555, 0x55ff55, 0xffff55, 0x5555ff, 0xff55ff, 0x55ffff, 0xffffff,
+    };
+    const char *const hex = "0123456789abcdef";
+    unsigned long rgb;
+    unsigned int i;
+
+    switch (color->type)
+      {
+        case SGR_COLOR_BASIC:
+          /* 30-37, 40-47, 90-97, 100-107 */
+          rgb = palette[color->val[0] % 10 + (color->val[0] >= 90 ? 8 : 0)];
+          break;
+        case SGR_COLOR_256:
+          {
+            const unsigned int n = color->val[0];
+            if (n < 16)
+              rgb = palette[n];
+            else if (n < 232)
+              {
+                const unsigned int levels[6] = { 0, 95, 135, 175, 215, 255 };
+                rgb = ((unsigned long)levels[(n - 16) / 36] << 16) | (levels[(n - 16) / 6 % 6] << 8) | levels[(n - 16) % 6];
+              }
+            else
+              {
+                const unsigned long grey = 8 + (n - 232) * 10;
+                rgb = (grey << 16) | (grey << 8) | grey;
+              }
+          }
+          break;
+        case SGR_COLOR_RGB:
+          rgb = ((unsigned long)color->val[0] << 16) | (color->val[1] << 8) | color->val[2];
+          break;
+        case SGR_COLOR_DEFAULT:
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+    style[0] = '#';
+    for (i = 0; i < 6; i++)
+      style[6 - i] = hex[(rgb >> (i * 4)) & 0xf];
+    style[7] = ';';
+    return 8;
+}
+
+static void
+html_put (const char *p, size_t len)
+{
+    while (len)
+      {
+        size_t n = sizeof (html_conv.out) - html_conv.out_len;
+        if (n == 0)
+          {
+            html_flush ();
+            continue;
+          }
+        if (n > len)
+          n = len;
+        memcpy (html_conv.out + html_conv.out_len, p, n);
+        html_conv.out_len += n;
+        p += n;
+        len -= n;
+      }
+}
+
+static bool
+html_flush (void)
+{
+    const bool ok = write_out (html_conv.out, html_conv.out_len);
+
+    html_conv.out_len = 0;
+    return ok;
+}
+
+static void
+open_trace (void)
+{
+    if (!trace_file)
+      trace_stream = stderr;
+    else if (!(trace_stream = fopen (trace_file, "w")))
+      vfprintf_fail (formats[FMT_FILE], trace_file, strerror (errno));
+}
+
+/* Called once the lines of a chunk have been printed.  Output still
+   buffered by stdio is accounted to the chunk when it is written.  */
+static void
+trace_chunk (void)
+{
+    const off_t end = trace.written + (off_t)PENDING_OUTPUT (out);
+
+    if (end <= trace.produced) /* nothing printed */
+      return;
+    trace.produced = end;
+
+    if (end <= trace.written)
+      hist_add (&trace.latency, &trace.chunk_read, &trace.last_write);
+    else if (trace.len == TRACE_QUEUE_MAX) /* coalesce with newest chunk */
+      trace.queue[(trace.head + trace.len - 1) % TRACE_QUEUE_MAX].end = end;
+    else
+      {
+        const unsigned int i = (trace.head + trace.len++) % TRACE_QUEUE_MAX;
+        trace.queue[i].end = end;
+        trace.queue[i].read = trace.chunk_read;
+      }
+}
+
+static void
+trace_written (size_t size)
+{
+    trace.written += size;
+
+    while (trace.len && trace.queue[trace.head].end <= trace.written)
+      {
+        hist_add (&trace.latency, &trace.queue[trace.head].read, &trace.last_write);
+        trace.head = (trace.head + 1) % TRACE_QUEUE_MAX;
+        trace.len--;
+      }
+}
+
+/* Values below 2 * TRACE_HIST_SUB have a bucket each, greater ones are
+   shifted into [TRACE_HIST_SUB, 2 * TRACE_HIST_SUB) per power of two.  */
+static void
+hist_add (struct latency_hist *hist, const struct timespec *t1, const struct timespec *t2)
+{
+    const double nsecs = (t2->tv_sec - t1->tv_sec) * 1e9 + (t2->tv_nsec - t1->tv_nsec);
+    const unsigned long val = nsecs <= 0 ? 0 : nsecs >= (double)ULONG_MAX ? ULONG_MAX : (unsigned long)nsecs;
+    unsigned int shift = 0;
+
+    while ((val >> shift) >= 2 * TRACE_HIST_SUB)
+      shift++;
+    hist->counts[shift * TRACE_HIST_SUB + (val >> shift)]++;
+    hist->count++;
+    hist->sum += val;
+    if (val > hist->max)
+      hist->max = val;
+}
+
+/* Highest value equivalent to the bucket reached, in nanoseconds */
+static double
+hist_percentile (const struct latency_hist *hist, double percentile)
+{
+    const double rank = hist->count * percentile / 100.0;
+    unsigned long seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof (hist->counts) / sizeof (hist->counts[0]); i++)
+      {
+        seen += hist->counts[i];
+        if (hist->count && seen >= rank)
+          {
+            const unsigned int shift = i < 2 * TRACE_HIST_SUB ? 0 : i / TRACE_HIST_SUB - 1;
+            const double val = (double)(((i - shift * TRACE_HIST_SUB) + 1UL) << shift) - 1;
+            return val < hist->max ? val : hist->max;
+          }
+      }
+    return 0;
+}
+
+static void
+report_latency (void)
+{
+    const struct {
+        const char *name;
+        const struct latency_hist *hist;
+    } rows[] = {
+        { "input to output", &trace.latency    },
+        { "write wait",      &trace.write_wait },
+    };
+    unsigned int i;
+
+    fprintf (trace_stream, "%-16s %10s %10s %10s %10s %10s %12s\n",
+             "latency (us)", "count", "p50", "p99", "max", "mean", "total");
+    for (i = 0; i < sizeof (rows) / sizeof (rows[0]); i++)
+      {
+        const struct latency_hist *hist = rows[i].hist;
+        fprintf (trace_stream, "%-16s %10lu %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+                 rows[i].name, hist->count,
+                 hist_percentile (hist, 50.0) / 1e3,
+                 hist_percentile (hist, 99.0) / 1e3,
+                 hist->max / 1e3,
+                 hist->count ? hist->sum / hist->count / 1e3 : 0.0,
+                 hist->sum / 1e3);
+      }
+    if (trace_stream != stderr && fclose (trace_stream) == EOF)
+      vfprintf_fail (formats[FMT_FILE], trace_file, strerror (errno));
+    trace_stream = NULL;
+}
+
+static void
+setup_buffering (FILE *stream)
+{
+    int mode;
+
+    switch (frame_rate ? FLUSH_FULL : flush_mode)
+      {
+        case FLUSH_LINE:
+          mode = _IOLBF;
+          break;
+        case FLUSH_AUTO:
+        case FLUSH_FULL:
+          mode = _IOFBF;
+          break;
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+    /* -o, --output: buffer is in use by stdout until exit */
+    if (output_file)
+      {
+        void *buf;
+        if (posix_memalign (&buf, OUTPUT_ALIGN, OUTPUT_BUF_SIZE) != 0)
+#if !DEBUG
+          MEM_ALLOC_FAIL ();
+#else
+          MEM_ALLOC_FAIL_DEBUG (__FILE__, __LINE__);
+#endif
+        setvbuf (out, buf, mode, OUTPUT_BUF_SIZE);
+      }
+    else
+      setvbuf (out, NULL, mode, 0);
+
+    /* fread() blocks until the buffer is filled, hence read whatever
+       is available from pipes and terminals in order to let the output
+       be flushed as soon as the input goes idle.  */
+    if (flush_mode == FLUSH_AUTO || frame_rate || timestamp)
+      {
+        struct stat sb;
+        if (fstat (fileno (stream), &sb) == 0 && !S_ISREG (sb.st_mode))
+          {
+            setvbuf (stream, NULL, _IONBF, 0);
+            raw_input = true;
+          }
+      }
+}
+
+static void
+read_print_stream (const char *attr, const struct color **colors, const char *file, FILE *stream)
+{
+    char buf[BUF_SIZE + 1];
+    bool eof = false;
+
+    /* --lines */
+    if (lines_start > line_number)
+      skip_lines (stream);
+
+    while (!eof)
+      {
+        size_t bytes_read;
+        char *line;
+        bool end = false;
+        if (frame_rate)
+          frame_wait (stream);
+        bytes_read = read_chunk (buf, CHUNK_SIZE, stream, &eof);
+        if (trace_latency)
+          clock_gettime (CLOCK_MONOTONIC, &trace.chunk_read);
+        if (timestamp)
+          clock_gettime (CLOCK_REALTIME, &stamp.now);
+        PROBE2 (chunk__read, buf, bytes_read);
+        buf[bytes_read] = '\0';
+        line = print_lines (attr, colors, file, buf, buf + bytes_read, &end);
+        /* --lines */
+        if (end)
+          {
+            copy_rest (line, buf, stream, eof);
+            return;
+          }
+        if (lines_range && line_number < lines_start)
+          {
+            if (pass_through)
+              print_untouched (line, 0);
+          }
+        else if (eof)
+          {
+            if (*line != '\0' || color_open)
+              print_line_func (attr, colors, line, 0, true);
+            if (tee_stream)
+              tee_line (line, 0);
+          }
+        else if (*line != '\0')
+          {
+            char *p;
+            if ((clean || normalize) && (p = strrchr (line, '\033')))
+              merge_print_line (line, p, stream);
+            else if (clean_all && (p = (char *)find_part_esc (line)))
+              merge_print_line (line, p, stream);
+            else
+              {
+                print_line_func (attr, colors, line, PARTIAL, true);
+                if (tee_stream)
+                  tee_line (line, PARTIAL);
+              }
+          }
+        if (flush_mode == FLUSH_AUTO && !frame_rate)
+          flush_auto (stream);
+        if (trace_latency)
+          trace_chunk ();
+      }
+
+    /* --minimal-escapes */
+    if (sgr_colors[FOREGROUND])
+      fprintf (out, "\033[0m");
+    /* --normalize */
+    if (normalize)
+      print_sgr_diff ();
+}
+
+/* --exec: returns the exit status of the command */
+static int
+run_exec (const char *file)
+{
+    int pipes[2][2];
+    unsigned int i, open_streams = 2;
+    int status;
+    pid_t pid;
+
+    for (i = 0; i < 2; i++)
+      if (pipe (pipes[i]) == -1)
+        vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+    if ((pid = fork ()) == -1)
+      vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+    if (pid == 0)
+      {
+        if (dup2 (pipes[0][1], STDOUT_FILENO) == -1 || dup2 (pipes[1][1], STDERR_FILENO) == -1)
+          _exit (127);
+        for (i = 0; i < 2; i++)
+          {
+            close (pipes[i][0]);
+            close (pipes[i][1]);
+          }
+        execl ("/bin/sh", "sh", "-c", exec_command, (char *)NULL);
+        vfprintf_diag (formats[FMT_FILE], "/bin/sh", strerror (errno));
+        _exit (127);
+      }
+    for (i = 0; i < 2; i++)
+      {
+        close (pipes[i][1]);
+        exec_streams[i].fd = pipes[i][0];
+      }
+
+    while (open_streams)
+      {
+        struct pollfd pfds[2];
+        struct exec_stream *ready[2], *held;
+        unsigned int n = 0;
+        int timeout = -1;
+        for (i = 0; i < 2; i++)
+          {
+            struct exec_stream *exec_stream = &exec_streams[i];
+            if (exec_stream->fd == -1)
+              continue;
+            pfds[n].fd = exec_stream->fd;
+            pfds[n].events = POLLIN;
+            pfds[n].revents = 0;
+            ready[n++] = exec_stream;
+          }
+        /* --max-fps */
+        if (frame_rate)
+          timeout = frame_due ();
+        else if (flush_mode == FLUSH_AUTO && poll (pfds, n, 0) == 0)
+          fflush (out);
+        if (poll (pfds, n, timeout) == -1)
+          {
+            if (errno == EINTR)
+              continue;
+            vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+          }
+        for (i = 0; i < n; i++)
+          if (pfds[i].revents && !exec_read (ready[i], file))
+            {
+              close (ready[i]->fd);
+              ready[i]->fd = -1;
+              open_streams--;
+            }
+        while ((held = exec_held ()))
+          exec_drain (held, file);
+      }
+    for (i = 0; i < 2; i++)
+      free (exec_streams[i].held);
+
+    /* --minimal-escapes */
+    if (sgr_colors[FOREGROUND])
+      fprintf (out, "\033[0m");
+    /* --normalize */
+    if (normalize)
+      print_sgr_diff ();
+
+    while (waitpid (pid, &status, 0) == -1)
+      if (errno != EINTR)
+        vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+    if (WIFEXITED (status))
+      return WEXITSTATUS (status);
+    return WIFSIGNALED (status) ? 128 + WTERMSIG (status) : EXIT_FAILURE;
+}
+
+/* Returns false at end of stream.  */
+static bool
+exec_read (struct exec_stream *exec_stream, const char *file)
+{
+    const struct exec_stream *other = &exec_streams[exec_stream == &exec_streams[0] ? 1 : 0];
+    ssize_t ret;
+
+    /* text held before is printed first */
+    if (other->mid_line || exec_stream->held_len)
+      return exec_hold (exec_stream);
+
+    do
+      ret = read (exec_stream->fd, exec_stream->buf + exec_stream->len, BUF_SIZE - exec_stream->len);
+    while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+      vfprintf_fail (formats[FMT_ERROR], (unsigned long)(BUF_SIZE - exec_stream->len), "read");
+    return exec_print (exec_stream, file, ret);
+}
+
+static bool
+exec_hold (struct exec_stream *exec_stream)
+{
+    ssize_t ret;
+
+    exec_hold_room (exec_stream, BUF_SIZE);
+    do
+      ret = read (exec_stream->fd, exec_stream->held + exec_stream->held_len, BUF_SIZE);
+    while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+      vfprintf_fail (formats[FMT_ERROR], (unsigned long)BUF_SIZE, "read");
+    exec_stream->held_len += ret;
+    if (ret == 0)
+      exec_stream->held_eof = true;
+    return ret != 0;
+}
+
+static void
+exec_hold_room (struct exec_stream *exec_stream, size_t len)
+{
+    if (exec_stream->held_size - exec_stream->held_len < len)
+      {
+        exec_stream->held_size = (exec_stream->held_len + len) * 2;
+        exec_stream->held = xrealloc (exec_stream->held, exec_stream->held_size);
+      }
+}
+
+/* Stream whose text held may be printed, the one not printed last
+   first, as its text was held earlier.  */
+static struct exec_stream *
+exec_held (void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2; i++)
+      {
+        const unsigned int n = exec_current == &exec_streams[0] ? !i : i;
+        struct exec_stream *exec_stream = &exec_streams[n];
+        if ((exec_stream->held_len || exec_stream->held_eof) && !exec_streams[!n].mid_line)
+          return exec_stream;
+      }
+    return NULL;
+}
+
+/* Text held is printed as if read by now.  Printing stops early once
+   exec_print() holds the rest anew.  */
+static void
+exec_drain (struct exec_stream *exec_stream, const char *file)
+{
+    char *const held = exec_stream->held;
+    const size_t held_len = exec_stream->held_len;
+    size_t offset = 0;
+
+    exec_stream->held = NULL;
+    exec_stream->held_len = exec_stream->held_size = 0;
+    while (offset < held_len && !exec_stream->held_len)
+      {
+        const size_t room = BUF_SIZE - exec_stream->len;
+        const size_t len = held_len - offset < room ? held_len - offset : room;
+        memcpy (exec_stream->buf + exec_stream->len, held + offset, len);
+        offset += len;
+        exec_print (exec_stream, file, len);
+      }
+    if (offset < held_len)
+      {
+        exec_hold_room (exec_stream, held_len - offset);
+        memcpy (exec_stream->held + exec_stream->held_len, held + offset, held_len - offset);
+        exec_stream->held_len += held_len - offset;
+      }
+    free (held);
+    if (exec_stream->held_eof && !exec_stream->held_len)
+      {
+        exec_stream->held_eof = false;
+        exec_print (exec_stream, file, 0);
+      }
+}
+
+/* Print the complete lines read, keep the rest for the next read.
+   Returns false at end of stream.  */
+static bool
+exec_print (struct exec_stream *exec_stream, const char *file, size_t ret)
+{
+    const struct exec_stream *other = &exec_streams[exec_stream == &exec_streams[0] ? 1 : 0];
+    char *const buf = exec_stream->buf;
+    char *line;
+    bool end = false;
+
+    if (trace_latency)
+      clock_gettime (CLOCK_MONOTONIC, &trace.chunk_read);
+    if (timestamp)
+      clock_gettime (CLOCK_REALTIME, &stamp.now);
+    PROBE2 (chunk__read, buf + exec_stream->len, ret);
+
+    if (exec_current != exec_stream)
+      {
+        exec_current = exec_stream;
+        if (!(clean || clean_all || normalize || field_colors))
+          {
+            line_seqs = &exec_stream->seqs;
+            print_lines = exec_stream->print_lines;
+            print_line_func = exec_stream->print_line_func;
+          }
+      }
+
+    /* text following NUL is dropped as with read_print_stream() */
+    buf[exec_stream->len + ret] = '\0';
+    exec_stream->len += strlen (buf + exec_stream->len);
+
+    /* the text held of the other stream precedes what follows the end
+       of a line printed in part */
+    if (exec_stream->mid_line && other->held_len && ret)
+      {
+        char *const eol = strpbrk (buf, "\n\r");
+        if (eol)
+          {
+            char *const rest = eol + (*eol == '\r' && *(eol + 1) == '\n' ? 2 : 1);
+            const size_t len = buf + exec_stream->len - rest;
+            exec_hold_room (exec_stream, len);
+            memcpy (exec_stream->held + exec_stream->held_len, rest, len);
+            exec_stream->held_len += len;
+            *rest = '\0';
+            exec_stream->len = rest - buf;
+          }
+      }
+
+    if (ret == 0)
+      {
+        if (exec_stream->len || color_open)
+          print_line_func (exec_stream->attr, exec_stream->colors, buf, 0, true);
+        if (tee_stream)
+          tee_line (buf, 0);
+        exec_stream->len = 0;
+        exec_stream->mid_line = false;
+        return false;
+      }
+
+    line = print_lines (exec_stream->attr, exec_stream->colors, file, buf, buf + exec_stream->len, &end);
+    /* lines gathered refer to the text moved below */
+    if (gather_output)
+      gather_flush ();
+    if (line != buf)
+      exec_stream->mid_line = false;
+    exec_stream->len -= line - buf;
+    if (exec_stream->len == BUF_SIZE)
+      {
+        print_line_func (exec_stream->attr, exec_stream->colors, buf, PARTIAL, true);
+        if (tee_stream)
+          tee_line (buf, PARTIAL);
+        exec_stream->len = 0;
+        exec_stream->mid_line = true;
+      }
+    else
+      memmove (buf, line, exec_stream->len);
+    if (trace_latency)
+      trace_chunk ();
+    return true;
+}
+
+/* Line loops specialized per mode, so that options are not tested
+   per line.  Return the text following the last line ending; *end is
+   set once the end of --lines has been reached.  */
+#define PRINT_LINES(name, print, range, tee)                                         \
+static char *                                                                        \
+name (const char *attr, const struct color **colors, const char *file, char *line, const char *chunk_end, bool *end) \
+{                                                                                    \
+    char *eol;                                                                       \
+    UNUSED (chunk_end); /* NUL ends the chunk for strpbrk() */                       \
+    while ((eol = strpbrk (line, "\n\r")))                                           \
+      {                                                                              \
+        const bool has_text = (eol > line);                                          \
+        unsigned int flags = 0;                                                      \
+        char *p;                                                                     \
+        if (*eol == '\r')                                                            \
+          {                                                                          \
+            flags |= CR;                                                             \
+            if (*(eol + 1) == '\n')                                                  \
+              flags |= LF;                                                           \
+          }                                                                          \
+        else if (*eol == '\n')                                                       \
+          flags |= LF;                                                               \
+        else /* never reached */                                                     \
+          vfprintf_fail (formats[FMT_FILE], file, "unrecognized line ending");       \
+        p = eol + SKIP_LINE_ENDINGS (flags);                                         \
+        *eol = '\0';                                                                 \
+        if (range && line_number < lines_start)                                      \
+          {                                                                          \
+            if (pass_through)                                                        \
+              print_untouched (line, flags);                                         \
+          }                                                                          \
+        else                                                                         \
+          {                                                                          \
+            print (attr, colors, line, flags, omit_color_empty ? has_text : true);   \
+            if (tee)                                                                 \
+              tee_line (line, flags);                                                \
+          }                                                                          \
+        line = p;                                                                    \
+        /* counted for the line__emit probe also */                                  \
+        if ((flags & LF) && line_number++ == lines_end && range)                     \
+          {                                                                          \
+            *end = true;                                                             \
+            break;                                                                   \
+          }                                                                          \
+      }                                                                              \
+    return line;                                                                     \
+}
+
+PRINT_LINES (print_lines_generic, print_line,       false, false)
+PRINT_LINES (print_lines_range,   print_line,       true,  tee_stream)
+PRINT_LINES (print_lines_color,   print_line_color, false, false)
+PRINT_LINES (print_lines_plain,   print_line_plain, false, false)
+PRINT_LINES (print_lines_tee,     print_line,       false, true)
+
+#undef PRINT_LINES
+
+/* --clean[-all]: sequences never span line endings, so the chunk is not
+   split into lines.  ESC and line endings are located in one pass and
+   the text in between valid sequences is written as whole runs.  The
+   text following the last line ending is left to the caller, and a NUL
+   byte ends the chunk as it does for strpbrk() in the loops above.  */
+static char *
+print_lines_clean (const char *attr, const struct color **colors, const char *file, char *line, const char *chunk_end, bool *end)
+{
+    const char *text = line, *p = line, *rest = line;
+    const char *limit = chunk_end;
+
+    UNUSED (attr);
+    UNUSED (colors);
+    UNUSED (file);
+    UNUSED (end);
+    while (limit > line && *(limit - 1) != '\n' && *(limit - 1) != '\r')
+      limit--;
+
+    for (;;)
+      {
+        const char *q = find_esc_eol (p, limit);
+        if (q == limit)
+          break;
+        if (*q == '\033')
+          {
+            const char *seq_end = match_esc (q);
+            if (seq_end)
+              {
+                if (q > text)
+                  print_text (text, q - text);
+                text = p = seq_end + 1;
+              }
+            else
+              p = q + 1;
+          }
+        else if (*q == '\0')
+          {
+            limit = rest;
+            break;
+          }
+        else
+          {
+            /* CR LF is one line ending */
+            if (*q == '\n')
+              {
+                PROBE3 (line__emit, rest, q > rest && *(q - 1) == '\r' ? CR|LF : LF, line_number);
+                line_number++;
+              }
+            else if (*(q + 1) != '\n')
+              PROBE3 (line__emit, rest, CR, line_number);
+            else
+              {
+                p = q + 1;
+                continue;
+              }
+            rest = p = q + 1;
+          }
+      }
+    if (limit > text)
+      {
+        print_text (text, limit - text);
+        text = limit;
+      }
+    return (char *)text;
+}
+
+/* Skip lines before the start of --lines by counting newlines over
+   the mapped file instead of reading it line by line.  */
+static void
+skip_lines (FILE *stream)
+{
+    struct stat sb;
+    off_t offset, map_offset;
+    size_t map_size;
+    unsigned long count;
+    char *map;
+    const char *start, *p;
+    const int fd = fileno (stream);
+
+    if (fd == -1 || fstat (fd, &sb) == -1 || !S_ISREG (sb.st_mode))
+      return;
+    if ((offset = ftello (stream)) == -1 || offset >= sb.st_size)
+      return;
+    map_offset = offset - offset % sysconf (_SC_PAGESIZE);
+    map_size = sb.st_size - map_offset;
+    if ((off_t)map_size != sb.st_size - map_offset)
+      return; /* too large to be mapped, read it instead */
+    map = mmap (NULL, map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+    if (map == MAP_FAILED)
+      return;
+    posix_madvise (map, map_size, POSIX_MADV_SEQUENTIAL);
+
+    start = map + (offset - map_offset);
+    count = lines_start - line_number;
+    p = skip_newlines (start, map + map_size, &count);
+    line_number = lines_start - count;
+    /* --pass-through: keep writes within the output buffer (--direct) */
+    if (pass_through)
+      {
+        const char *s;
+        for (s = start; s < p; s += BUF_SIZE)
+          print_text (s, (size_t)(p - s) < BUF_SIZE ? (size_t)(p - s) : BUF_SIZE);
+      }
+
+    munmap (map, map_size);
+    if (fseeko (stream, offset + (p - start), SEEK_SET) == -1)
+      vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+}
+
+/* Return the position after the count'th newline, newlines are
+   counted 16 bytes at a time where SSE2 is available.  */
+static const char *
+skip_newlines (const char *p, const char *end, unsigned long *count)
+{
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8 ('\n');
+    for (; *count && end - p >= 16; p += 16)
+      {
+        unsigned int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)p), newline));
+        const unsigned int newlines = __builtin_popcount (mask);
+        if (newlines < *count)
+          *count -= newlines;
+        else
+          {
+            for (; *count > 1; (*count)--)
+              mask &= mask - 1; /* clear lowest bit */
+            *count = 0;
+            return p + __builtin_ctz (mask) + 1;
+          }
+      }
+#endif
+    while (*count && p < end)
+      {
+        const char *newline = memchr (p, '\n', end - p);
+        if (!newline)
+          return end;
+        p = newline + 1;
+        (*count)--;
+      }
+    return p;
+}
+
+static void
+print_untouched (const char *line, unsigned int flags)
+{
+    print_text (line, strlen (line));
+    if (flags & CR)
+      putc ('\r', out);
+    if (flags & LF)
+      putc ('\n', out);
+}
+
+/* End of --lines reached: stop reading or pass the rest through.  */
+static void
+copy_rest (const char *line, char *buf, FILE *stream, bool eof)
+{
+    /* --minimal-escapes */
+    if (sgr_colors[FOREGROUND])
+      {
+        fprintf (out, "\033[0m");
+        sgr_colors[FOREGROUND] = sgr_colors[BACKGROUND] = NULL;
+      }
+    /* --normalize */
+    if (normalize)
+      {
+        memset (&sgr_wanted, 0, sizeof (struct sgr_state));
+        print_sgr_diff ();
+      }
+
+    if (!pass_through)
+      return;
+    print_text (line, strlen (line));
+    while (!eof)
+      {
+        const size_t bytes_read = read_chunk (buf, BUF_SIZE, stream, &eof);
+        print_text (buf, bytes_read);
+      }
+}
+
+static size_t
+read_chunk (char *buf, size_t size, FILE *stream, bool *eof)
+{
+    size_t bytes_read = 0;
+
+    if (!raw_input)
+      {
+        bytes_read = fread (buf, 1, size, stream);
+        if (bytes_read != size && ferror (stream))
+          vfprintf_fail (formats[FMT_ERROR], (unsigned long)size, "read");
+        *eof = !!feof (stream);
+        return bytes_read;
+      }
+
+    /* end-of-file seen by complete_part_line() */
+    if (feof (stream))
+      {
+        *eof = true;
+        return 0;
+      }
+    /* character pushed back by complete_part_line() */
+    if (char_pushed_back)
+      {
+        buf[bytes_read++] = (char)fgetc (stream);
+        char_pushed_back = false;
+        if (bytes_read == size || !input_pending (stream))
+          return bytes_read;
+      }
+    for (;;)
+      {
+        ssize_t ret;
+        errno = 0;
+        ret = read (fileno (stream), buf + bytes_read, size - bytes_read);
+        if (ret == -1)
+          {
+            if (errno == EINTR)
+              continue;
+            vfprintf_fail (formats[FMT_ERROR], (unsigned long)size, "read");
+          }
+        else if (ret == 0)
+          *eof = true;
+        bytes_read += ret;
+        return bytes_read;
+      }
+}
+
+static bool
+input_pending (FILE *stream)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fileno (stream);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return (poll (&pfd, 1, 0) > 0);
+}
+
+#define ELAPSED_MS(t1, t2) \
+    (((t2).tv_sec - (t1).tv_sec) * 1000L + ((t2).tv_nsec - (t1).tv_nsec) / 1000000L)
+
+static void
+flush_auto (FILE *stream)
+{
+    static struct timespec last_flush;
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    /* Coalesce output while more input is waiting, otherwise flush
+       right away.  Regular files always have input waiting, therefore
+       they get flushed once the deadline has passed only.  */
+    if ((raw_input && !input_pending (stream))
+     || ELAPSED_MS (last_flush, now) >= FLUSH_DEADLINE)
+      {
+        fflush (out);
+        last_flush = now;
+      }
+}
+
+/* --max-fps: frames are timed on a terminal only, otherwise nothing is
+   dropped.  */
+static void
+open_frames (void)
+{
+    struct winsize ws;
+
+    if (!isatty (STDOUT_FILENO))
+      {
+        frame_rate = 0;
+        return;
+      }
+    if ((opts_set & OPT_FLUSH_SET) && flush_mode != FLUSH_FULL)
+      vfprintf_diag ("--flush switch has no meaning with --max-fps");
+
+    frame.rows = (ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1) ? ws.ws_row : 24;
+    if (!frame_backlog)
+      frame_backlog = frame.rows;
+    frame.interval = 1000000000L / frame_rate;
+    clock_gettime (CLOCK_MONOTONIC, &frame.next);
+}
+
+static void
+frame_add (const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *const end = buf + len;
+
+    if (frame.len + len > frame.size)
+      {
+        frame.size = (frame.len + len) * 2;
+        frame.buf = xrealloc (frame.buf, frame.size);
+      }
+    memcpy (frame.buf + frame.len, buf, len);
+    frame.len += len;
+
+    while ((p = memchr (p, '\n', end - p)))
+      {
+        frame.lines++;
+        p++;
+      }
+    if (frame.lines > frame_backlog)
+      frame_trim ();
+}
+
+/* Keep the lines fitting on screen below the marker line, along with
+   a line not yet complete.  */
+static void
+frame_trim (void)
+{
+    const unsigned long keep = frame.rows - 1 < frame_backlog ? frame.rows - 1 : frame_backlog;
+    char *p = frame.buf + frame.len;
+    unsigned long endings = 0;
+
+    while (p > frame.buf && !(*(p - 1) == '\n' && ++endings > keep))
+      p--;
+    frame.len -= p - frame.buf;
+    memmove (frame.buf, p, frame.len);
+    frame.skipped += frame.lines - keep;
+    frame.lines = keep;
+}
+
+static void
+frame_show (void)
+{
+    bool ok = true;
+
+    if (frame.skipped)
+      {
+        char marker[64];
+        sprintf (marker, "\033[0m%s\033[7m[%lu lines skipped]\033[0m\n", frame.mid_line ? "\n" : "", frame.skipped);
+        ok = write_all (marker, strlen (marker));
+        frame.skipped = 0;
+        frame.mid_line = false;
+      }
+    if (frame.len)
+      {
+        ok = write_all (frame.buf, frame.len) && ok;
+        frame.mid_line = frame.buf[frame.len - 1] != '\n';
+      }
+    frame.len = 0;
+    frame.lines = 0;
+    if (!ok)
+      vfprintf_fail (formats[FMT_GENERIC], strerror (errno));
+
+    clock_gettime (CLOCK_MONOTONIC, &frame.next);
+    frame.next.tv_nsec += frame.interval;
+    if (frame.next.tv_nsec >= 1000000000L)
+      {
+        frame.next.tv_sec++;
+        frame.next.tv_nsec -= 1000000000L;
+      }
+}
+
+/* Return milliseconds until the pending frame is due, -1 if there is
+   none pending (anymore).  */
+static int
+frame_due (void)
+{
+    struct timespec now;
+    long remaining;
+
+    fflush (out);
+    if (!frame.len && !frame.skipped)
+      return -1;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    remaining = ELAPSED_MS (now, frame.next);
+    if (remaining <= 0)
+      {
+        frame_show ();
+        return -1;
+      }
+    return (int)remaining;
+}
+
+/* Output pending is shown when its frame is due, even if input has gone
+   idle meanwhile.  */
+static void
+frame_wait (FILE *stream)
+{
+    int timeout;
+
+    while ((timeout = frame_due ()) != -1)
+      {
+        struct pollfd pfd;
+        pfd.fd = fileno (stream);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll (&pfd, 1, timeout) != 0)
+          return;
+      }
+}
+
+static void
+merge_print_line (const char *line, const char *p, FILE *stream)
+{
+    char *buf = NULL;
+    char *merged_esc = NULL;
+    const char *esc = "";
+    const char char_restore = *p;
+
+    PROBE2 (merge__line, line, p);
+
+    if (clean_all)
+      complete_part_esc (p + 1, &buf, stream);
+    else
+      complete_part_line (p + 1, &buf, stream);
+
+    if (buf)
+      {
+        /* form escape sequence */
+        esc = merged_esc = str_concat (p, buf);
+        /* shorten partial line accordingly */
+        *(char *)p = '\0';
+        free (buf);
+      }
+
+#ifdef TEST_MERGE_PART_LINE
+    fprintf (out, "%s%s", line, esc);
+    fflush (out);
+    _exit (EXIT_SUCCESS);
+#else
+    if (normalize)
+      print_normalized (line, PARTIAL);
+    else
+      print_clean_func (line);
+    if (tee_stream)
+      tee_line (line, PARTIAL);
+    *(char *)p = char_restore;
+    if (normalize)
+      print_normalized (esc, PARTIAL);
+    else
+      print_clean_func (esc);
+    if (tee_stream)
+      tee_line (esc, PARTIAL);
+    free (merged_esc);
+#endif
+}
+
+static void
+complete_part_line (const char *p, char **buf, FILE *stream)
+{
+    bool got_next_char = false, read_from_stream;
+    char ch;
+    size_t i = 0, size;
+
+    if (get_next_char (&ch, &p, stream, &read_from_stream))
+      {
+        if (ch == '[')
+          {
+            if (read_from_stream)
+              save_char (ch, buf, &i, &size);
           }
         else
           {
             if (read_from_stream)
-              ungetc ((int)ch, stream);
+              unget_char (ch, stream);
             return; /* cancel */
           }
       }
@@ -1471,7 +5480,7 @@ complete_part_line (const char *p, char **buf, FILE *stream)
         else
           {
             if (read_from_stream)
-              ungetc ((int)ch, stream);
+              unget_char (ch, stream);
             return; /* cancel */
           }
       }
@@ -1479,6 +5488,49 @@ complete_part_line (const char *p, char **buf, FILE *stream)
       return; /* cancel */
 }
 
+static void
+complete_part_esc (const char *p, char **buf, FILE *stream)
+{
+    bool read_from_stream;
+    char ch;
+    size_t i = 0, size;
+    unsigned int state = ES_ESC;
+
+    while (state < ES_FINAL && get_next_char (&ch, &p, stream, &read_from_stream))
+      {
+        state = esc_transitions[state][esc_classes[(unsigned char)ch]];
+        if (state == ES_REJECT || state == ES_INCOMPLETE)
+          {
+            if (read_from_stream)
+              unget_char (ch, stream);
+            return; /* cancel */
+          }
+        if (read_from_stream)
+          {
+            save_char (ch, buf, &i, &size);
+            if (i == MAX_ESC_SEQUENCE_CHARS)
+              return; /* cancel */
+          }
+      }
+}
+
+static const char *
+find_part_esc (const char *line)
+{
+    const char *esc;
+    const char *p = line;
+
+    while ((esc = strchr (p, '\033')))
+      {
+        const char *end;
+        const enum esc_state state = scan_esc (esc, &end);
+        if (state == ES_INCOMPLETE)
+          return esc;
+        p = state == ES_REJECT ? esc + 1 : end + 1;
+      }
+    return NULL;
+}
+
 static bool
 get_next_char (char *ch, const char **p, FILE *stream, bool *read_from_stream)
 {
@@ -1506,6 +5558,14 @@ get_next_char (char *ch, const char **p, FILE *stream, bool *read_from_stream)
       }
 }
 
+static void
+unget_char (char ch, FILE *stream)
+{
+    ungetc ((int)ch, stream);
+    if (raw_input)
+      char_pushed_back = true;
+}
+
 static void
 save_char (char ch, char **buf, size_t *i, size_t *size)
 {
@@ -1593,15 +5653,436 @@ find_color_entry (const struct color_name *color_name, unsigned int index, const
       vfprintf_fail (formats[FMT_COLOR], tables[index].desc, color_name->orig, "not recognized");
 }
 
+static void
+init_hash_palette (const struct color **colors)
+{
+    unsigned int i;
+
+    for (i = 1; i < tables[FOREGROUND].count - 1; i++) /* skip color none and default */
+      {
+        const struct color *entry = &tables[FOREGROUND].entries[i];
+        /* --exclude-random */
+        if (exclude && streq (exclude, entry->name))
+          continue;
+        if (colors[BACKGROUND] && streq (colors[BACKGROUND]->name, entry->name))
+          continue;
+        hash_palette[hash_palette_count++] = entry;
+      }
+    hash_fallback = colors[FOREGROUND];
+}
+
+/* FNV-1a, so that keys map to the same color across runs and machines  */
+static const struct color *
+hash_color (const char *line)
+{
+    unsigned long hash = 2166136261UL;
+    const char *key;
+    size_t len;
+
+    if (!find_hash_key (line, &key, &len))
+      return hash_fallback;
+    while (len--)
+      hash = ((hash ^ (unsigned char)*key++) * 16777619UL) & 0xffffffffUL;
+
+    return hash_palette[hash % hash_palette_count];
+}
+
+static bool
+find_hash_key (const char *line, const char **key, size_t *len)
+{
+    if (hash_field)
+      {
+        const char *p = line;
+        const char *const end = line + strlen (line);
+        unsigned int field;
+        for (field = 1;; field++)
+          {
+            const char *delim;
+            /* Fields are counted as by --field-colors.  */
+            if (field_delimiter_run)
+              p += strspn (p, " ");
+            delim = find_delimiter (p, end, field_delimiter);
+            if (field == hash_field)
+              {
+                *key = p;
+                *len = delim - p;
+                return *len > 0;
+              }
+            if (delim == end)
+              return false;
+            p = delim + 1;
+          }
+      }
+    else
+      {
+        regmatch_t match[2];
+        unsigned int i;
+        if (regexec (&hash_regex, line, 2, match, 0) != 0)
+          return false;
+        i = match[1].rm_so != -1 ? 1 : 0; /* capture or whole match */
+        *key = line + match[i].rm_so;
+        *len = match[i].rm_eo - match[i].rm_so;
+        return true;
+      }
+}
+
+static void
+select_print_funcs (const char *attr, const struct color **colors)
+{
+    print_lines = print_lines_generic;
+    print_line_func = print_line;
+
+    /* --rainbow=char|word */
+    if (rainbow_unit != RAINBOW_LINE)
+      init_rainbow_units (attr, colors);
+
+    /* --lines */
+    if (lines_range)
+      print_lines = print_lines_range;
+    /* --tee */
+    else if (tee_stream)
+      print_lines = print_lines_tee;
+    /* --clean[-all]; --timestamp is printed by print_line() */
+    else if ((clean || clean_all) && !timestamp)
+      {
+        print_lines = print_lines_clean;
+        print_line_func = print_line_clean;
+      }
+    /* same colors for each line */
+    else if (!normalize && !field_colors && !hash_key && !rainbow_fg && !rainbow_bg && !minimal_escapes && !timestamp)
+      {
+        if (colors[FOREGROUND]->code)
+          {
+            int len = 0;
+            /* Foreground color code is guaranteed to be set when background color code is present.  */
+            if (colors[BACKGROUND] && colors[BACKGROUND]->code)
+              len = sprintf (line_seqs->color_prefix, "\033[%s", colors[BACKGROUND]->code);
+            line_seqs->color_prefix_len = len + sprintf (line_seqs->color_prefix + len, "\033[%s%s", attr, colors[FOREGROUND]->code);
+            if (gather_output)
+              {
+                print_lines = print_lines_gather;
+                print_line_func = print_line_gather;
+              }
+            else
+              {
+                print_lines = print_lines_color;
+                print_line_func = print_line_color;
+              }
+          }
+        else
+          {
+            print_lines = print_lines_plain;
+            print_line_func = print_line_plain;
+          }
+      }
+}
+
+/* --exec: printing functions and sequences of each stream are chosen
+   once; exec_read() switches between them.  */
+static void
+select_exec_print_funcs (void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2; i++)
+      {
+        struct exec_stream *exec_stream = &exec_streams[i];
+        line_seqs = &exec_stream->seqs;
+        select_print_funcs (exec_stream->attr, exec_stream->colors);
+        exec_stream->print_lines = print_lines;
+        exec_stream->print_line_func = print_line_func;
+      }
+}
+
+static void
+print_line_clean (const char *attr, const struct color **colors, const char *const line, unsigned int flags, bool emit_colors)
+{
+    UNUSED (attr);
+    UNUSED (colors);
+    UNUSED (emit_colors);
+    PROBE3 (line__emit, line, flags, line_number);
+    print_clean_func (line);
+    if (flags & CR)
+      putc ('\r', out);
+    if (flags & LF)
+      putc ('\n', out);
+}
+
+static void
+print_line_color (const char *attr, const struct color **colors, const char *const line, unsigned int flags, bool emit_colors)
+{
+    UNUSED (attr);
+    UNUSED (colors);
+    PROBE3 (line__emit, line, flags, line_number);
+    /* continue line spanning several buffers */
+    if (color_open)
+      {
+        fputs (line, out);
+        if (!(flags & PARTIAL))
+          {
+            fputs ("\033[0m", out);
+            color_open = false;
+          }
+      }
+    /* skip for --omit-color-empty? */
+    else if (emit_colors)
+      {
+        fputs (line_seqs->color_prefix, out);
+        fputs (line, out);
+        /* Reset at the real end of line only.  */
+        if (flags & PARTIAL)
+          color_open = true;
+        else
+          fputs ("\033[0m", out);
+      }
+    if (flags & CR)
+      putc ('\r', out);
+    if (flags & LF)
+      putc ('\n', out);
+}
+
+/* The lines of a chunk are gathered and written at once before the
+   chunk is reused by the next read.  */
+static char *
+print_lines_gather (const char *attr, const struct color **colors, const char *file, char *line, const char *chunk_end, bool *end)
+{
+    char *eol;
+
+    UNUSED (attr);
+    UNUSED (colors);
+    UNUSED (file);
+    UNUSED (chunk_end);
+    UNUSED (end);
+    fflush (out);
+    while ((eol = strpbrk (line, "\n\r")))
+      {
+        unsigned int flags = 0;
+        if (*eol == '\r')
+          {
+            flags |= CR;
+            if (*(eol + 1) == '\n')
+              flags |= LF;
+          }
+        else
+          flags |= LF;
+        gather_line (line, eol - line, flags, omit_color_empty ? eol > line : true);
+        if (flags & LF)
+          line_number++;
+        line = eol + SKIP_LINE_ENDINGS (flags);
+      }
+    /* otherwise written along with the partial line by print_line_gather() */
+    if (*line == '\0')
+      gather_flush ();
+    return line;
+}
+
+static void
+print_line_gather (const char *attr, const struct color **colors, const char *const line, unsigned int flags, bool emit_colors)
+{
+    UNUSED (attr);
+    UNUSED (colors);
+    fflush (out);
+    gather_line (line, strlen (line), flags, emit_colors);
+    gather_flush ();
+}
+
+/* Output equals that of print_line_color() */
+static void
+gather_line (const char *line, size_t len, unsigned int flags, bool emit_colors)
+{
+    static const char *const endings[] = { "", "\r", "\n", "\r\n" };
+    const bool color = color_open || emit_colors;
+
+    PROBE3 (line__emit, line, flags, line_number);
+    if (!color_open && emit_colors)
+      gather_put (line_seqs->color_prefix, line_seqs->color_prefix_len);
+    if (len >= GATHER_MIN)
+      {
+        if (gather.iov_cnt == GATHER_IOV)
+          gather_flush ();
+        gather.iov[gather.iov_cnt].iov_base = (void *)line;
+        gather.iov[gather.iov_cnt++].iov_len = len;
+      }
+    else
+      gather_put (line, len);
+    if (flags & PARTIAL)
+      color_open = color;
+    else
+      {
+        const char *const ending = endings[((flags & CR) ? 1 : 0) + ((flags & LF) ? 2 : 0)];
+        if (color)
+          gather_put ("\033[0m", 4);
+        gather_put (ending, strlen (ending));
+        color_open = false;
+      }
+}
+
+static void
+gather_put (const char *p, size_t len)
+{
+    struct iovec *last;
+
+    if (gather.stage_len + len > sizeof (gather.stage) || gather.iov_cnt == GATHER_IOV)
+      gather_flush ();
+    assert (len <= sizeof (gather.stage));
+
+    last = gather.iov_cnt ? &gather.iov[gather.iov_cnt - 1] : NULL;
+    memcpy (gather.stage + gather.stage_len, p, len);
+    /* extend the staged text last referenced */
+    if (last && (char *)last->iov_base + last->iov_len == gather.stage + gather.stage_len)
+      last->iov_len += len;
+    else
+      {
+        gather.iov[gather.iov_cnt].iov_base = gather.stage + gather.stage_len;
+        gather.iov[gather.iov_cnt++].iov_len = len;
+      }
+    gather.stage_len += len;
+}
+
+static void
+gather_flush (void)
+{
+    struct iovec *iov = gather.iov;
+    unsigned int cnt = gather.iov_cnt;
+
+    while (cnt)
+      {
+        ssize_t ret = writev (STDOUT_FILENO, iov, cnt);
+        if (ret == -1)
+          {
+            if (errno == EINTR)
+              continue;
+            vfprintf_fail (formats[FMT_ERROR], (unsigned long)iov->iov_len, "written");
+          }
+        /* partial write */
+        while (cnt && (size_t)ret >= iov->iov_len)
+          {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+          }
+        if (cnt)
+          {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+          }
+      }
+    gather.iov_cnt = 0;
+    gather.stage_len = 0;
+}
+
+static void
+print_line_plain (const char *attr, const struct color **colors, const char *const line, unsigned int flags, bool emit_colors)
+{
+    UNUSED (attr);
+    UNUSED (colors);
+    UNUSED (emit_colors);
+    PROBE3 (line__emit, line, flags, line_number);
+    fputs (line, out);
+    if (flags & CR)
+      putc ('\r', out);
+    if (flags & LF)
+      putc ('\n', out);
+}
+
+static void
+format_timestamp (void)
+{
+    const size_t size = sizeof (stamp.text) - 1; /* separator */
+    struct tm tm;
+    size_t len;
+
+    stamp.sec = stamp.now.tv_sec;
+    localtime_r (&stamp.sec, &tm);
+    len = strftime (stamp.text, size, stamp.head, &tm);
+    if (stamp.fraction)
+      {
+        if (len + 7 >= size)
+          {
+            stamp.len = 0;
+            return;
+          }
+        stamp.frac_pos = len + 1;
+        memcpy (stamp.text + len, ".000000", 7);
+        len += 7;
+        len += strftime (stamp.text + len, size - len, stamp.tail, &tm);
+      }
+    if (len)
+      stamp.text[len++] = ' ';
+    stamp.len = len;
+}
+
+static void
+print_timestamp (void)
+{
+    if (stamp.now.tv_sec != stamp.sec)
+      format_timestamp ();
+    if (stamp.fraction)
+      {
+        unsigned long usecs = stamp.now.tv_nsec / 1000;
+        char *p = stamp.text + stamp.frac_pos + 6;
+        while (p-- > stamp.text + stamp.frac_pos)
+          {
+            *p = '0' + usecs % 10;
+            usecs /= 10;
+          }
+      }
+    /* separator is left uncolored */
+    if (*timestamp_seq)
+      {
+        fputs (timestamp_seq, out);
+        fwrite (stamp.text, 1, stamp.len - 1, out);
+        fputs ("\033[0m ", out);
+        /* --minimal-escapes: colors of the line are to be emitted anew */
+        sgr_colors[FOREGROUND] = sgr_colors[BACKGROUND] = NULL;
+      }
+    else
+      fwrite (stamp.text, 1, stamp.len, out);
+}
+
 static void
 print_line (const char *attr, const struct color **colors, const char *const line, unsigned int flags, bool emit_colors)
 {
+    PROBE3 (line__emit, line, flags, line_number);
+
+    /* --timestamp */
+    if (timestamp)
+      {
+        if (stamp.line_start)
+          print_timestamp ();
+        stamp.line_start = !(flags & PARTIAL);
+      }
+
     /* --clean[-all] */
     if (clean || clean_all)
-      print_clean (line);
+      print_clean_func (line);
+    /* --normalize */
+    else if (normalize)
+      print_normalized (line, flags);
+    /* --field-colors */
+    else if (field_colors)
+      print_fields (line, flags);
+    /* --rainbow=char|word */
+    else if (rainbow_unit != RAINBOW_LINE)
+      print_rainbow_units (line, flags, emit_colors);
+    /* continue line spanning several buffers */
+    else if (color_open)
+      {
+        fprintf (out, formats[FMT_GENERIC], line);
+        if (!(flags & PARTIAL))
+          {
+            if (!minimal_escapes)
+              fprintf (out, "\033[0m");
+            color_open = false;
+          }
+      }
     /* skip for --omit-color-empty? */
     else if (emit_colors)
       {
+        /* --hash-key */
+        if (hash_key)
+          colors[FOREGROUND] = hash_color (line);
+
         /* --rainbow{-fg,-bg} */
         if (rainbow_fg || rainbow_bg)
           {
@@ -1628,23 +6109,427 @@ print_line (const char *attr, const struct color **colors, const char *const lin
 
             colors[color_iter] = (struct color *)&tables[color_iter].entries[index];
 
-            if (!(flags & PARTIAL))
-              rainbow_index = index + 1;
+            /* Lines spanning several buffers are colored once only.  */
+            rainbow_index = index + 1;
           }
 
-        /* Foreground color code is guaranteed to be set when background color code is present.  */
-        if (colors[BACKGROUND] && colors[BACKGROUND]->code)
-          printf ("\033[%s", colors[BACKGROUND]->code);
-        if (colors[FOREGROUND]->code)
-          printf ("\033[%s%s%s\033[0m", attr, colors[FOREGROUND]->code, line);
+        /* --minimal-escapes: keep colors in effect across lines  */
+        if (minimal_escapes && sgr_colors[FOREGROUND]
+         && sgr_colors[FOREGROUND] == colors[FOREGROUND] && sgr_colors[BACKGROUND] == colors[BACKGROUND])
+          {
+            if (sgr_bg_erased)
+              fprintf (out, "\033[%s", colors[BACKGROUND]->code);
+            sgr_bg_erased = false;
+            fprintf (out, formats[FMT_GENERIC], line);
+          }
         else
-          printf (formats[FMT_GENERIC], line);
+          {
+            /* Foreground color code is guaranteed to be set when background color code is present.  */
+            if (colors[BACKGROUND] && colors[BACKGROUND]->code)
+              fprintf (out, "\033[%s", colors[BACKGROUND]->code);
+            if (colors[FOREGROUND]->code)
+              {
+                fprintf (out, "\033[%s%s%s", attr, colors[FOREGROUND]->code, line);
+                if (minimal_escapes)
+                  {
+                    sgr_colors[FOREGROUND] = colors[FOREGROUND];
+                    sgr_colors[BACKGROUND] = colors[BACKGROUND];
+                    sgr_bg_erased = false;
+                  }
+              }
+            else
+              fprintf (out, formats[FMT_GENERIC], line);
+          }
+        if (colors[FOREGROUND]->code)
+          {
+            /* Reset at the real end of line only.  */
+            if (flags & PARTIAL)
+              color_open = true;
+            else if (!minimal_escapes)
+              fprintf (out, "\033[0m");
+          }
+      }
+    /* --minimal-escapes: reset for lines left uncolored  */
+    else if (sgr_colors[FOREGROUND])
+      {
+        fprintf (out, "\033[0m%s", line);
+        sgr_colors[FOREGROUND] = sgr_colors[BACKGROUND] = NULL;
+      }
+    /* --minimal-escapes: background off before line ending */
+    if ((flags & (CR|LF)) && sgr_colors[FOREGROUND] && sgr_colors[BACKGROUND] && sgr_colors[BACKGROUND]->code
+     && !sgr_bg_erased)
+      {
+        fprintf (out, "\033[49m");
+        sgr_bg_erased = true;
       }
     if (flags & CR)
-      putchar ('\r');
+      putc ('\r', out);
     if (flags & LF)
-      putchar ('\n');
+      putc ('\n', out);
+}
+
+static void
+print_fields (const char *line, unsigned int flags)
+{
+    const char *p = line;
+    const char *const end = line + strlen (line);
+
+    while (p < end)
+      {
+        const char *delim = find_delimiter (p, end, field_delimiter);
+        if (delim > p)
+          {
+            if (!field_state.started)
+              {
+                const unsigned int i = field_state.index;
+                /* fields not listed, within or past the last one, take the color of '*' */
+                const char *seq = field_seqs[i <= field_max && field_seqs[i].set ? i : 0].seq;
+                if (*seq)
+                  {
+                    fprintf (out, formats[FMT_GENERIC], seq);
+                    color_open = true;
+                  }
+                field_state.started = true;
+              }
+            print_text (p, delim - p);
+          }
+        if (delim == end)
+          break;
+        if (color_open)
+          {
+            fprintf (out, "\033[0m");
+            color_open = false;
+          }
+        /* Fields past the last one listed share the same color.  */
+        if ((field_state.started || !field_delimiter_run) && field_state.index <= field_max)
+          field_state.index++;
+        field_state.started = false;
+        putc (*delim, out);
+        p = delim + 1;
+      }
+
+    /* Fields of a line spanning several buffers are continued.  */
+    if (!(flags & PARTIAL))
+      {
+        if (color_open)
+          {
+            fprintf (out, "\033[0m");
+            color_open = false;
+          }
+        field_state.index = 1;
+        field_state.started = false;
+      }
+}
+
+/* Sequences of the rainbow plane in the order used, skipping the color
+   of the other plane as get_rainbow_index() does.  */
+static void
+init_rainbow_units (const char *attr, const struct color **colors)
+{
+    const unsigned int color_iter = rainbow_fg ? FOREGROUND : BACKGROUND;
+    const unsigned int color_cmp = rainbow_fg ? BACKGROUND : FOREGROUND;
+    const unsigned int max_index = tables[color_iter].count - 2; /* omit color default */
+    unsigned int i, index = colors[color_iter]->index;
+    struct line_seqs *const seqs = line_seqs;
+
+    seqs->rainbow_seqs_count = 0;
+    seqs->rainbow_pos = 0;
+    seqs->rainbow_prefix[0] = '\0';
+    for (i = 0; i < max_index; i++, index = index % max_index + 1)
+      {
+        const char *code = tables[color_iter].entries[index].code;
+        if (skipable_rainbow_index (colors, color_cmp, index))
+          continue;
+        seqs->rainbow_seqs[seqs->rainbow_seqs_count].len = sprintf (seqs->rainbow_seqs[seqs->rainbow_seqs_count].seq, "\033[%s%s",
+                                                                    color_iter == FOREGROUND ? attr : "", code);
+        seqs->rainbow_seqs_count++;
+      }
+    /* the other plane is set once per line */
+    if (color_iter == BACKGROUND)
+      sprintf (seqs->rainbow_prefix, "\033[%s%s", attr, colors[FOREGROUND]->code);
+    else if (colors[BACKGROUND] && colors[BACKGROUND]->code)
+      sprintf (seqs->rainbow_prefix, "\033[%s", colors[BACKGROUND]->code);
+}
+
+#define RAINBOW_PUT(p, n)                        \
+    do {                                         \
+        const size_t len_ = (n);                 \
+        if (out_len + len_ > sizeof (out))       \
+          {                                      \
+            print_text (out, out_len);           \
+            out_len = 0;                         \
+          }                                      \
+        if (len_ > sizeof (out))                 \
+          print_text ((p), len_);                \
+        else                                     \
+          {                                      \
+            memcpy (out + out_len, (p), len_);   \
+            out_len += len_;                     \
+          }                                      \
+    } while (0)
+
+/* --rainbow=char|word: the color changes with each code point or word.
+   Whitespace and UTF-8 continuation bytes stay with the preceding unit,
+   so that runs sharing a color are written at once.  Output is assembled
+   from the precomputed sequences in a local buffer.  Escape sequences
+   (as recognized by --clean-all) are copied untouched; one cut by the
+   end of a buffer is held back until the next part of the line.  */
+static void
+print_rainbow_units (const char *line, unsigned int flags, bool emit_colors)
+{
+    static char out[4096];
+    size_t out_len = 0;
+    struct line_seqs *const seqs = line_seqs;
+    char *merged = NULL;
+    const char *end, *p, *run, *skip;
+
+    if (rainbow_held_len)
+      {
+        line = merged = str_concat (rainbow_held, line);
+        rainbow_held_len = 0;
+      }
+    end = line + strlen (line);
+    run = skip = line;
+
+    if (!color_open)
+      {
+        if (!emit_colors)
+          {
+            print_text (line, end - line);
+            free (merged);
+            return;
+          }
+        RAINBOW_PUT (seqs->rainbow_prefix, strlen (seqs->rainbow_prefix));
+        rainbow_space = true;
+        /* leading whitespace is colored too */
+        if (line < end && *line != '\033')
+          {
+            RAINBOW_PUT (seqs->rainbow_seqs[seqs->rainbow_pos].seq, seqs->rainbow_seqs[seqs->rainbow_pos].len);
+            seqs->rainbow_pos = (seqs->rainbow_pos + 1) % seqs->rainbow_seqs_count;
+            skip = line + 1;
+          }
+      }
+
+    for (p = line; p < end; p += 16)
+      {
+        const unsigned int n = end - p < 16 ? (unsigned int)(end - p) : 16;
+        unsigned int mask = find_unit_starts (p, n, &rainbow_space);
+        while (mask)
+          {
+            const char *q = p + __builtin_ctz (mask);
+            mask &= mask - 1;
+            if (q < skip)
+              continue;
+            /* escape sequences are copied untouched */
+            if (*q == '\033')
+              {
+                const char *seq_end;
+                const enum esc_state state = scan_esc (q, &seq_end);
+                if (state > ES_REJECT)
+                  skip = seq_end + 1;
+                else if (state == ES_INCOMPLETE && *seq_end == '\0' && (flags & PARTIAL)
+                      && (size_t)(seq_end - q) < sizeof (rainbow_held))
+                  {
+                    rainbow_held_len = seq_end - q;
+                    memcpy (rainbow_held, q, rainbow_held_len + 1);
+                    end = q;
+                    break;
+                  }
+                else
+                  skip = q + 1; /* stray ESC */
+                continue;
+              }
+            RAINBOW_PUT (run, q - run);
+            RAINBOW_PUT (seqs->rainbow_seqs[seqs->rainbow_pos].seq, seqs->rainbow_seqs[seqs->rainbow_pos].len);
+            seqs->rainbow_pos = (seqs->rainbow_pos + 1) % seqs->rainbow_seqs_count;
+            run = q;
+          }
+        if (rainbow_held_len)
+          break;
+      }
+    RAINBOW_PUT (run, end - run);
+
+    /* Reset at the real end of line only.  */
+    if (flags & PARTIAL)
+      color_open = true;
+    else
+      {
+        RAINBOW_PUT ("\033[0m", 4);
+        color_open = false;
+      }
+    print_text (out, out_len);
+    free (merged);
+}
+
+#undef RAINBOW_PUT
+
+/* Bit mask of units starting within n (at most 16) bytes: code points
+   (lead bytes) or words, not starting with whitespace, and of ESC.  */
+static unsigned int
+find_unit_starts (const char *p, unsigned int n, bool *space)
+{
+    unsigned int lead = 0, spaces = 0, escs = 0, i;
+
+#ifdef __SSE2__
+    if (n == 16)
+      {
+        const __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+        escs = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\033')));
+        spaces = _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+                                                  _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t'))));
+        /* continuation bytes are 0x80-0xbf, i.e. below -64 signed */
+        lead = _mm_movemask_epi8 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 (-65)));
+      }
+    else
+#endif
+      for (i = 0; i < n; i++)
+        {
+          const unsigned char c = (unsigned char)p[i];
+          if (c == ' ' || c == '\t')
+            spaces |= 1U << i;
+          if ((c & 0xc0) != 0x80)
+            lead |= 1U << i;
+          if (c == '\033')
+            escs |= 1U << i;
+        }
+
+    if (rainbow_unit == RAINBOW_WORD)
+      {
+        /* non-whitespace preceded by whitespace */
+        lead = ~spaces & ((spaces << 1) | (*space ? 1 : 0));
+      }
+    else
+      lead &= ~spaces;
+    *space = (spaces >> (n - 1)) & 1;
+    /* sequences are found wherever they start */
+    return (lead | escs) & ((n == 16) ? 0xffffU : (1U << n) - 1);
+}
+
+/* Delimiters are located 16 bytes at a time where SSE2 is available.  */
+static const char *
+find_delimiter (const char *p, const char *end, char delim)
+{
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8 (delim);
+    for (; end - p >= 16; p += 16)
+      {
+        const unsigned int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)p), needle));
+        if (mask)
+          return p + __builtin_ctz (mask);
+      }
+#endif
+    p = memchr (p, delim, end - p);
+    return p ? p : end;
+}
+
+/* Variants are probed once; forcing one through --scanner that the
+   CPU lacks is an error rather than a crash.  */
+static void
+init_scanners (void)
+{
+    if (scanner_count)
+      return;
+#define ADD_SCANNER(n, f, u) do { scanners[scanner_count].name = n; scanners[scanner_count].func = f; scanners[scanner_count].usable = u; scanner_count++; } while (0)
+#ifdef HAVE_CPU_DISPATCH
+    __builtin_cpu_init ();
+    ADD_SCANNER ("avx512", find_esc_eol_avx512, __builtin_cpu_supports ("avx512bw") != 0);
+    ADD_SCANNER ("avx2",   find_esc_eol_avx2,   __builtin_cpu_supports ("avx2") != 0);
+#endif
+#ifdef __SSE2__
+    ADD_SCANNER ("sse2",   find_esc_eol_sse2,   true);
+#endif
+    ADD_SCANNER ("scalar", find_esc_eol_scalar, true);
+#undef ADD_SCANNER
+}
+
+static void
+select_scanner (const char *name)
+{
+    unsigned int i;
+
+    init_scanners ();
+    for (i = 0; i < scanner_count; i++)
+      if (name ? streq (name, scanners[i].name) : scanners[i].usable)
+        {
+          if (!scanners[i].usable)
+            vfprintf_fail (formats[FMT_QUOTE], "--scanner switch variant", name, "not supported by CPU");
+          find_esc_eol = scanners[i].func;
+          scanner_name = scanners[i].name;
+          return;
+        }
+    vfprintf_fail (formats[FMT_QUOTE], "--scanner switch variant", name, "not available");
+}
+
+/* Locate the first ESC, line ending or NUL byte before end (or return
+   end).  Vector variants fall back to the scalar one for the tail.  */
+static const char *
+find_esc_eol_scalar (const char *p, const char *end)
+{
+    for (; p < end; p++)
+      switch (*p)
+        {
+          case '\033':
+          case '\n':
+          case '\r':
+          case '\0':
+            return p;
+          default:
+            break;
+        }
+    return end;
+}
+
+#ifdef __SSE2__
+static const char *
+find_esc_eol_sse2 (const char *p, const char *end)
+{
+    const __m128i esc = _mm_set1_epi8 ('\033'), lf = _mm_set1_epi8 ('\n'), cr = _mm_set1_epi8 ('\r');
+    const __m128i nul = _mm_setzero_si128 ();
+    for (; end - p >= 16; p += 16)
+      {
+        const __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+        const unsigned int mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, esc), _mm_cmpeq_epi8 (v, lf)),
+                                                                   _mm_or_si128 (_mm_cmpeq_epi8 (v, cr), _mm_cmpeq_epi8 (v, nul))));
+        if (mask)
+          return p + __builtin_ctz (mask);
+      }
+    return find_esc_eol_scalar (p, end);
+}
+#endif
+
+#ifdef HAVE_CPU_DISPATCH
+static const char *
+find_esc_eol_avx2 (const char *p, const char *end)
+{
+    const __m256i esc = _mm256_set1_epi8 ('\033'), lf = _mm256_set1_epi8 ('\n'), cr = _mm256_set1_epi8 ('\r');
+    const __m256i nul = _mm256_setzero_si256 ();
+    for (; end - p >= 32; p += 32)
+      {
+        const __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+        const unsigned int mask = _mm256_movemask_epi8 (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, esc), _mm256_cmpeq_epi8 (v, lf)),
+                                                                         _mm256_or_si256 (_mm256_cmpeq_epi8 (v, cr), _mm256_cmpeq_epi8 (v, nul))));
+        if (mask)
+          return p + __builtin_ctz (mask);
+      }
+    return find_esc_eol_scalar (p, end);
+}
+
+static const char *
+find_esc_eol_avx512 (const char *p, const char *end)
+{
+    const __m512i esc = _mm512_set1_epi8 ('\033'), lf = _mm512_set1_epi8 ('\n'), cr = _mm512_set1_epi8 ('\r');
+    const __m512i nul = _mm512_setzero_si512 ();
+    for (; end - p >= 64; p += 64)
+      {
+        const __m512i v = _mm512_loadu_si512 ((const void *)p);
+        const __mmask64 mask = _mm512_cmpeq_epi8_mask (v, esc) | _mm512_cmpeq_epi8_mask (v, lf)
+                             | _mm512_cmpeq_epi8_mask (v, cr) | _mm512_cmpeq_epi8_mask (v, nul);
+        if (mask)
+          return p + __builtin_ctzll (mask);
+      }
+    return find_esc_eol_scalar (p, end);
 }
+#endif
 
 static unsigned int
 get_rainbow_index (const struct color **colors, unsigned int color_cmp, unsigned int index, unsigned int max)
@@ -1673,6 +6558,7 @@ skipable_rainbow_index (const struct color **colors, unsigned int color_cmp, uns
     return (index == colors[color_cmp]->index);
 }
 
+#if defined (FUZZ) || defined (BENCH)
 static void
 print_clean (const char *line)
 {
@@ -1689,7 +6575,100 @@ print_clean (const char *line)
         p = get_end_of_esc (text_end);
       }
 }
+#endif
+
+/* Single pass variant of print_clean(): valid sequences are matched
+   once and text in between is written as whole runs.  */
+static void
+print_clean_fast (const char *line)
+{
+    const char *text = line, *p = line;
+    const char *esc;
+
+    while ((esc = strchr (p, '\033')))
+      {
+        const char *end = match_esc (esc);
+        if (end)
+          {
+            if (esc > text)
+              print_text (text, esc - text);
+            text = p = end + 1;
+          }
+        else
+          p = esc + 1;
+      }
+    if (*text != '\0')
+      print_text (text, strlen (text));
+}
+
+static const char *
+match_esc (const char *p)
+{
+    const char *end;
+
+    /* --clean-all */
+    if (clean_all)
+      {
+        const enum esc_state state = scan_esc (p, &end);
+        if (!(state > ES_REJECT && (clean_all_seqs & ES_SEQ (state))))
+          {
+            PROBE2 (esc__rejected, p, end + 1 - p);
+            return NULL;
+          }
+      }
+    /* --clean */
+    else if (!(end = match_esc_clean (p)))
+      {
+        PROBE2 (esc__rejected, p, 1);
+        return NULL;
+      }
+    PROBE2 (esc__matched, p, end + 1 - p);
+    return end;
+}
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/* Equivalent to gather_esc_offsets() for --clean: attributes (1-9)
+   followed by ; may precede a foreground color only, reset and
+   background colors stand alone.  Values have 2 digits at most.  */
+static const char *
+match_esc_clean (const char *p)
+{
+    bool attrs = false;
+
+    if (*(p + 1) != '[')
+      return NULL;
+    p += 2;
+    for (;;)
+      {
+        unsigned int value;
+        if (!IS_DIGIT (*p))
+          return NULL;
+        value = *p++ - '0';
+        if (IS_DIGIT (*p))
+          value = value * 10 + (*p++ - '0');
+        if (IS_DIGIT (*p))
+          return NULL;
+        if (*p == ';')
+          {
+            if (value < 1 || value > 9)
+              return NULL;
+            attrs = true;
+            p++;
+            continue;
+          }
+        else if (*p != 'm')
+          return NULL;
+        else if ((value >= 30 && value <= 37) || value == 39)
+          return p;
+        else if (!attrs && (value == 0 || (value >= 40 && value <= 47) || value == 49))
+          return p;
+        else
+          return NULL;
+      }
+}
 
+#if defined (FUZZ) || defined (BENCH)
 static bool
 is_esc (const char *p)
 {
@@ -1709,6 +6688,7 @@ get_end_of_esc (const char *p)
       }
     return end ? end + 1 : p + strlen (p);
 }
+#endif
 
 static const char *
 get_end_of_text (const char *p)
@@ -1728,7 +6708,7 @@ static void
 print_text (const char *p, size_t len)
 {
     size_t bytes_written;
-    bytes_written = fwrite (p, 1, len, stdout);
+    bytes_written = fwrite (p, 1, len, out);
     if (bytes_written != len)
       vfprintf_fail (formats[FMT_ERROR], (unsigned long)len, "written");
 }
@@ -1736,14 +6716,36 @@ print_text (const char *p, size_t len)
 static bool
 gather_esc_offsets (const char *p, const char **start, const char **end)
 {
+    const char *const seq = p;
+
+    /* --clean-all */
+    if (clean_all)
+      {
+        const char *last;
+        enum esc_state state;
+        if (*p != 27)
+          return false;
+        state = scan_esc (p, &last);
+        if (state > ES_REJECT && (clean_all_seqs & ES_SEQ (state)))
+          {
+            if (start)
+              *start = p;
+            if (end)
+              *end = last;
+            PROBE2 (esc__matched, p, last + 1 - p);
+            return true;
+          }
+        PROBE2 (esc__rejected, p, last + 1 - p);
+        return false;
+      }
     /* ESC[ */
     if (*p == 27 && *(p + 1) == '[')
       {
         bool valid = false;
         const char *const begin = p;
         p += 2;
-        if (clean_all)
-          valid = validate_esc_clean_all (&p);
+        if (normalize)
+          valid = validate_esc_sgr (&p);
         else if (clean)
           {
             bool check_values;
@@ -1780,14 +6782,29 @@ gather_esc_offsets (const char *p, const char **start, const char **end)
               *start = begin;
             if (end)
               *end = p;
+            PROBE2 (esc__matched, begin, p + 1 - begin);
             return true;
           }
       }
+    if (*seq == 27)
+      PROBE2 (esc__rejected, seq, p + 1 - seq);
     return false;
 }
 
+static enum esc_state
+scan_esc (const char *p, const char **end)
+{
+    unsigned int state = ES_ESC;
+
+    while (state < ES_FINAL)
+      state = esc_transitions[state][esc_classes[(unsigned char)*++p]];
+
+    *end = p;
+    return (enum esc_state)state;
+}
+
 static bool
-validate_esc_clean_all (const char **p)
+validate_esc_sgr (const char **p)
 {
     while (isdigit ((unsigned char)**p) || **p == ';')
       (*p)++;
@@ -1815,27 +6832,260 @@ validate_esc_clean (int value, unsigned int iter, unsigned int *prev_iter, const
 }
 
 static bool
-is_reset (int value, unsigned int iter, const char **p)
+is_reset (int value, unsigned int iter, const char **p)
+{
+    return (value == 0 && iter == 1 && **p == 'm');
+}
+
+static bool
+is_attr (int value, unsigned int iter, unsigned int prev_iter, const char **p)
+{
+    return ((value > 0 && value < 10) && (iter - prev_iter == 1) && **p == ';');
+}
+
+static bool
+is_fg_color (int value, const char **p)
+{
+    return (((value >= 30 && value <= 37) || value == 39) && **p == 'm');
+}
+
+static bool
+is_bg_color (int value, unsigned int iter, const char **p)
+{
+    return (((value >= 40 && value <= 47) || value == 49) && iter == 1 && **p == 'm');
+}
+
+static void
+print_normalized (const char *line, unsigned int flags)
+{
+    const char *p = line;
+
+    while (*p != '\0')
+      {
+        const char *text_end = get_end_of_text (p);
+        const char *end;
+        struct sgr_state before;
+        if (text_end > p)
+          {
+            print_sgr_diff ();
+            print_text (p, text_end - p);
+          }
+        if (*text_end == '\0')
+          break;
+        gather_esc_offsets (text_end, NULL, &end);
+        /* Parameters which are not modelled cannot be coalesced,
+           hence emit the sequence as is, preceded by the changes still
+           pending from before it.  */
+        before = sgr_wanted;
+        if (!apply_sgr (text_end + 2, end, &sgr_wanted))
+          {
+            const struct sgr_state after = sgr_wanted;
+            sgr_wanted = before;
+            print_sgr_diff ();
+            print_text (text_end, end + 1 - text_end);
+            sgr_wanted = sgr_emitted = after;
+          }
+        p = end + 1;
+      }
+    /* Leave the state at the end of line as it was requested.  */
+    if (!(flags & PARTIAL))
+      print_sgr_diff ();
+}
+
+#define SGR_VALUE_MAX 99999
+
+static bool
+apply_sgr (const char *p, const char *end, struct sgr_state *state)
+{
+    unsigned long values[32];
+    unsigned int count = 0, i;
+    bool known = true;
+
+    /* gather values; empty ones equal 0 */
+    while (p <= end)
+      {
+        unsigned long value = 0;
+        while (isdigit ((unsigned char)*p))
+          {
+            if (value < SGR_VALUE_MAX)
+              value = value * 10 + (*p - '0');
+            p++;
+          }
+        if (count == COUNT_OF (values, unsigned long))
+          {
+            state->unknown = true;
+            return false;
+          }
+        values[count++] = value;
+        p++; /* skip ; or m */
+      }
+
+    for (i = 0; i < count; i++)
+      {
+        const unsigned long value = values[i];
+        if (value == 0)
+          memset (state, 0, sizeof (struct sgr_state)); /* reset */
+        else if (value <= 9)
+          state->attrs |= 1 << value;
+        else if (value == 22)
+          state->attrs &= ~((1 << 1) | (1 << 2));
+        else if (value == 25)
+          state->attrs &= ~((1 << 5) | (1 << 6));
+        else if (value >= 23 && value <= 29 && value != 26)
+          state->attrs &= ~(1 << (value - 20));
+        else if ((value >= 30 && value <= 37) || (value >= 90 && value <= 97))
+          {
+            state->fg.type = SGR_COLOR_BASIC;
+            state->fg.val[0] = (unsigned int)value;
+          }
+        else if ((value >= 40 && value <= 47) || (value >= 100 && value <= 107))
+          {
+            state->bg.type = SGR_COLOR_BASIC;
+            state->bg.val[0] = (unsigned int)value;
+          }
+        else if (value == 39)
+          state->fg.type = SGR_COLOR_DEFAULT;
+        else if (value == 49)
+          state->bg.type = SGR_COLOR_DEFAULT;
+        else if (value == 38 || value == 48)
+          {
+            struct sgr_color *color = value == 38 ? &state->fg : &state->bg;
+            if (!apply_sgr_color (values, count, &i, color))
+              {
+                state->unknown = true;
+                return false; /* remaining values cannot be interpreted */
+              }
+          }
+        else
+          {
+            state->unknown = true;
+            known = false;
+          }
+      }
+    return known;
+}
+
+static bool
+apply_sgr_color (unsigned long *values, unsigned int count, unsigned int *i, struct sgr_color *color)
 {
-    return (value == 0 && iter == 1 && **p == 'm');
+    unsigned int j;
+
+    /* 38;5;n and 48;5;n */
+    if (*i + 2 < count && values[*i + 1] == 5 && values[*i + 2] <= 255)
+      {
+        color->type = SGR_COLOR_256;
+        color->val[0] = (unsigned int)values[*i + 2];
+        *i += 2;
+        return true;
+      }
+    /* 38;2;r;g;b and 48;2;r;g;b */
+    else if (*i + 4 < count && values[*i + 1] == 2)
+      {
+        for (j = 0; j < 3; j++)
+          {
+            if (values[*i + 2 + j] > 255)
+              return false;
+            color->val[j] = (unsigned int)values[*i + 2 + j];
+          }
+        color->type = SGR_COLOR_RGB;
+        *i += 4;
+        return true;
+      }
+    return false;
 }
 
 static bool
-is_attr (int value, unsigned int iter, unsigned int prev_iter, const char **p)
+sgr_color_equal (const struct sgr_color *color1, const struct sgr_color *color2)
 {
-    return ((value > 0 && value < 10) && (iter - prev_iter == 1) && **p == ';');
+    if (color1->type != color2->type)
+      return false;
+    switch (color1->type)
+      {
+        case SGR_COLOR_DEFAULT:
+          return true;
+        case SGR_COLOR_BASIC:
+        case SGR_COLOR_256:
+          return (color1->val[0] == color2->val[0]);
+        case SGR_COLOR_RGB:
+          return (color1->val[0] == color2->val[0]
+               && color1->val[1] == color2->val[1]
+               && color1->val[2] == color2->val[2]);
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+    return false;
 }
 
-static bool
-is_fg_color (int value, const char **p)
+static void
+print_sgr_diff (void)
 {
-    return (((value >= 30 && value <= 37) || value == 39) && **p == 'm');
+    /* attribute n is switched off by code attrs_off[n] */
+    const unsigned int attrs_off[] = { 0, 22, 22, 23, 24, 25, 25, 27, 28, 29 };
+    const struct sgr_state *want = &sgr_wanted, *have = &sgr_emitted;
+    char seq[128];
+    size_t len = 0;
+    unsigned int attrs_set, n;
+    bool reset;
+
+    if (want->attrs == have->attrs && want->unknown == have->unknown
+     && sgr_color_equal (&want->fg, &have->fg) && sgr_color_equal (&want->bg, &have->bg))
+      return;
+
+    reset = (have->unknown && !want->unknown)
+         || (!want->attrs && want->fg.type == SGR_COLOR_DEFAULT && want->bg.type == SGR_COLOR_DEFAULT && !want->unknown);
+
+    if (reset)
+      {
+        len += sprintf (seq + len, "0;");
+        attrs_set = want->attrs;
+      }
+    else
+      {
+        unsigned int attrs_cleared = 0;
+        for (n = 1; n <= 9; n++)
+          if ((have->attrs & (1 << n)) && !(want->attrs & (1 << n)) && !(attrs_cleared & (1 << n)))
+            {
+              unsigned int m;
+              len += sprintf (seq + len, "%u;", attrs_off[n]);
+              for (m = 1; m <= 9; m++)
+                if (attrs_off[m] == attrs_off[n])
+                  attrs_cleared |= 1 << m;
+            }
+        attrs_set = want->attrs & ~(have->attrs & ~attrs_cleared);
+      }
+    for (n = 1; n <= 9; n++)
+      if (attrs_set & (1 << n))
+        len += sprintf (seq + len, "%u;", n);
+    if (reset ? want->fg.type != SGR_COLOR_DEFAULT : !sgr_color_equal (&want->fg, &have->fg))
+      len += format_sgr_color (seq + len, 30, &want->fg);
+    if (reset ? want->bg.type != SGR_COLOR_DEFAULT : !sgr_color_equal (&want->bg, &have->bg))
+      len += format_sgr_color (seq + len, 40, &want->bg);
+
+    if (len > 0)
+      {
+        seq[len - 1] = '\0'; /* strip trailing ; */
+        fprintf (out, "\033[%sm", seq);
+      }
+    sgr_emitted = sgr_wanted;
 }
 
-static bool
-is_bg_color (int value, unsigned int iter, const char **p)
+static size_t
+format_sgr_color (char *seq, unsigned int base, const struct sgr_color *color)
 {
-    return (((value >= 40 && value <= 47) || value == 49) && iter == 1 && **p == 'm');
+    switch (color->type)
+      {
+        case SGR_COLOR_DEFAULT:
+          return sprintf (seq, "%u;", base + 9);
+        case SGR_COLOR_BASIC:
+          return sprintf (seq, "%u;", color->val[0]);
+        case SGR_COLOR_256:
+          return sprintf (seq, "%u;5;%u;", base + 8, color->val[0]);
+        case SGR_COLOR_RGB:
+          return sprintf (seq, "%u;2;%u;%u;%u;", base + 8, color->val[0], color->val[1], color->val[2]);
+        default: /* never reached */
+          ABORT_TRACE ();
+      }
+    return 0;
 }
 
 #if !DEBUG
@@ -1845,6 +7095,7 @@ malloc_wrap (size_t size)
     void *p = malloc (size);
     if (!p)
       MEM_ALLOC_FAIL ();
+    PROBE2 (alloc, p, size);
     return p;
 }
 
@@ -1854,6 +7105,7 @@ calloc_wrap (size_t nmemb, size_t size)
     void *p = calloc (nmemb, size);
     if (!p)
       MEM_ALLOC_FAIL ();
+    PROBE2 (alloc, p, nmemb * size);
     return p;
 }
 
@@ -1863,6 +7115,7 @@ realloc_wrap (void *ptr, size_t size)
     void *p = realloc (ptr, size);
     if (!p)
       MEM_ALLOC_FAIL ();
+    PROBE2 (alloc, p, size);
     return p;
 }
 #else
@@ -1874,6 +7127,7 @@ malloc_wrap_debug (size_t size, const char *file, unsigned int line)
     if (!p)
       MEM_ALLOC_FAIL_DEBUG (file, line);
     fprintf (log, format_debug, program_name, "malloc'ed", (unsigned long)size, file, line);
+    PROBE2 (alloc, p, size);
     return p;
 }
 
@@ -1884,6 +7138,7 @@ calloc_wrap_debug (size_t nmemb, size_t size, const char *file, unsigned int lin
     if (!p)
       MEM_ALLOC_FAIL_DEBUG (file, line);
     fprintf (log, format_debug, program_name, "calloc'ed", (unsigned long)(nmemb * size), file, line);
+    PROBE2 (alloc, p, nmemb * size);
     return p;
 }
 
@@ -1894,6 +7149,7 @@ realloc_wrap_debug (void *ptr, size_t size, const char *file, unsigned int line)
     if (!p)
       MEM_ALLOC_FAIL_DEBUG (file, line);
     fprintf (log, format_debug, program_name, "realloc'ed", (unsigned long)size, file, line);
+    PROBE2 (alloc, p, size);
     return p;
 }
 #endif /* !DEBUG */
@@ -1927,9 +7183,9 @@ str_concat_wrap (const char *str1, const char *str2, const char *file, unsigned
     char *p, *str;
 
     p = str = do_malloc (len, file, line);
-    strncpy (p, str1, strlen (str1));
+    memcpy (p, str1, strlen (str1));
     p += strlen (str1);
-    strncpy (p, str2, strlen (str2));
+    memcpy (p, str2, strlen (str2));
     p += strlen (str2);
     *p = '\0';
 
@@ -2019,13 +7275,16 @@ open_file (const char *file, const char *mode)
     return stream;
 }
 
+/* stderr is locked, as --recursive workers diagnose concurrently */
 #define DO_VFPRINTF(fmt)                    \
     va_list ap;                             \
+    flockfile (stderr);                     \
     fprintf (stderr, "%s: ", program_name); \
     va_start (ap, fmt);                     \
     vfprintf (stderr, fmt, ap);             \
     va_end (ap);                            \
-    fprintf (stderr, "\n");
+    fprintf (stderr, "\n");                 \
+    funlockfile (stderr);
 
 static void
 vfprintf_diag (const char *fmt, ...)
@@ -2037,6 +7296,10 @@ static void
 vfprintf_fail (const char *fmt, ...)
 {
     DO_VFPRINTF (fmt);
+    /* out of memory on a --recursive worker: cleanup() would release
+       what the others still use */
+    if (walk.running)
+      _exit (EXIT_FAILURE);
     exit (EXIT_FAILURE);
 }
 
@@ -2101,3 +7364,609 @@ release (struct var_list *list, unsigned int stacked, void **ptr)
         }
     }
 }
+
+#ifdef FUZZ
+/* Differential fuzzing of print_clean() (reference) and
+   print_clean_fast() with identical inputs and buffer split points.
+
+   Standalone:  make fuzz; ./fuzz [-n ITERATIONS] [-s SEED] [FILE...]
+   AFL:         afl-fuzz -i in -o out ./fuzz @@
+   libFuzzer:   make fuzz CC=clang FLAGS="-fsanitize=fuzzer -DFUZZ_LIBFUZZER"  */
+
+enum { FUZZ_REFERENCE, FUZZ_FAST };
+
+static void fuzz_report (void);
+
+static struct {
+    char *data;
+    size_t len;
+    size_t size;
+} fuzz_output;
+
+static unsigned long fuzz_split_state;
+
+static struct {
+    unsigned long runs;
+    double bytes;
+    double secs[2];
+} fuzz_stats;
+
+static unsigned long
+fuzz_rand (unsigned long *state)
+{
+    /* xorshift32 */
+    unsigned long x = *state;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    return (*state = x);
+}
+
+static size_t
+fuzz_chunk_size (void)
+{
+    const unsigned long r = fuzz_rand (&fuzz_split_state);
+    /* favour short chunks, so that sequences are split often */
+    return (r & 3) ? r % 16 + 1 : r % BUF_SIZE + 1;
+}
+
+/* Standard output is redirected to a temporary file which is read
+   back and truncated after each run.  */
+static void
+fuzz_capture (void)
+{
+    off_t size;
+    ssize_t ret;
+
+    fflush (stdout);
+    size = lseek (STDOUT_FILENO, 0, SEEK_CUR);
+    if ((size_t)size > fuzz_output.size)
+      {
+        fuzz_output.size = size * 2;
+        fuzz_output.data = xrealloc (fuzz_output.data, fuzz_output.size);
+      }
+    fuzz_output.len = 0;
+    while (fuzz_output.len < (size_t)size
+        && (ret = pread (STDOUT_FILENO, fuzz_output.data + fuzz_output.len, size - fuzz_output.len, fuzz_output.len)) > 0)
+      fuzz_output.len += ret;
+    if (ftruncate (STDOUT_FILENO, 0) == -1 || lseek (STDOUT_FILENO, 0, SEEK_SET) == -1)
+      vfprintf_fail (formats[FMT_GENERIC], "cannot truncate captured output");
+}
+
+static void
+fuzz_init (void)
+{
+    FILE *file = tmpfile ();
+    if (!file || dup2 (fileno (file), STDOUT_FILENO) == -1)
+      vfprintf_fail (formats[FMT_GENERIC], "cannot capture standard output");
+    setvbuf (stdout, NULL, _IOFBF, 0);
+    out = stdout;
+    flush_mode = FLUSH_FULL;
+    init_scanners ();
+    atexit (fuzz_report);
+}
+
+static double
+fuzz_run (const unsigned char *data, size_t size, unsigned int impl, unsigned long seed)
+{
+    FILE *stream;
+    struct timespec t1, t2;
+
+    print_clean_func = impl == FUZZ_REFERENCE ? print_clean : print_clean_fast;
+    print_lines = impl == FUZZ_REFERENCE ? print_lines_generic : print_lines_clean;
+    if (impl == FUZZ_FAST)
+      {
+        /* rotate through the ESC scanners supported by the CPU */
+        unsigned int i = seed % scanner_count;
+        while (!scanners[i].usable)
+          i = (i + 1) % scanner_count;
+        find_esc_eol = scanners[i].func;
+        scanner_name = scanners[i].name;
+      }
+    fuzz_split_state = seed;
+
+    stream = fmemopen ((void *)data, size, "r");
+    if (!stream)
+      vfprintf_fail (formats[FMT_GENERIC], "fmemopen failed");
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    read_print_stream (NULL, NULL, "fuzz", stream);
+    fflush (out);
+    clock_gettime (CLOCK_MONOTONIC, &t2);
+    fclose (stream);
+    fuzz_capture ();
+
+    return (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+}
+
+static void
+fuzz_dump (const char *desc, const char *p, size_t len)
+{
+    size_t i;
+    fprintf (stderr, "%s (%lu bytes): ", desc, (unsigned long)len);
+    for (i = 0; i < len; i++)
+      {
+        const unsigned char c = (unsigned char)p[i];
+        if (c == 27)
+          fprintf (stderr, "\\e");
+        else if (isprint (c))
+          fputc (c, stderr);
+        else
+          fprintf (stderr, "\\x%02x", c);
+      }
+    fputc ('\n', stderr);
+}
+
+static void
+fuzz_one (const unsigned char *data, size_t size)
+{
+    unsigned int mode;
+    unsigned long seed = 2166136261UL;
+    size_t i;
+
+    /* fmemopen() may fail for zero sized buffers */
+    if (size == 0)
+      return;
+
+    for (i = 0; i < size; i++)
+      seed = ((seed ^ data[i]) * 16777619UL) & 0xffffffffUL;
+    if (seed == 0)
+      seed = 1;
+
+    for (mode = 0; mode < 2; mode++)
+      {
+        char *reference;
+        size_t reference_len;
+
+        clean = (mode == 0);
+        clean_all = (mode == 1);
+
+        fuzz_stats.secs[FUZZ_REFERENCE] += fuzz_run (data, size, FUZZ_REFERENCE, seed);
+        reference = xmalloc (fuzz_output.len + 1);
+        memcpy (reference, fuzz_output.data, fuzz_output.len);
+        reference_len = fuzz_output.len;
+        fuzz_stats.secs[FUZZ_FAST] += fuzz_run (data, size, FUZZ_FAST, seed);
+
+        if (reference_len != fuzz_output.len || memcmp (reference, fuzz_output.data, reference_len) != 0)
+          {
+            fprintf (stderr, "%s: output mismatch with --clean%s (split seed %lu, %s scanner)\n",
+                     program_name, clean_all ? "-all" : "", seed, scanner_name);
+            fuzz_dump ("input", (const char *)data, size);
+            fuzz_dump ("reference", reference, reference_len);
+            fuzz_dump ("fast", fuzz_output.data, fuzz_output.len);
+            abort ();
+          }
+        free (reference);
+        fuzz_stats.bytes += size;
+      }
+    fuzz_stats.runs++;
+}
+
+static void
+fuzz_report (void)
+{
+    const char *names[] = { "reference", "fast" };
+    unsigned int i;
+    fprintf (stderr, "%s: %lu inputs, %.0f bytes compared\n", program_name, fuzz_stats.runs, fuzz_stats.bytes);
+    for (i = 0; i < 2; i++)
+      fprintf (stderr, "%s: %-9s %8.2f MB/s\n", program_name, names[i],
+               fuzz_stats.secs[i] > 0 ? fuzz_stats.bytes / fuzz_stats.secs[i] / 1e6 : 0.0);
+}
+
+int LLVMFuzzerTestOneInput (const unsigned char *, size_t);
+
+int
+LLVMFuzzerTestOneInput (const unsigned char *data, size_t size)
+{
+    static bool initialized = false;
+    if (!initialized)
+      {
+        program_name = "fuzz";
+        fuzz_init ();
+        initialized = true;
+      }
+    fuzz_one (data, size);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static size_t
+fuzz_generate (unsigned char *data, size_t max, unsigned long *state)
+{
+    const char *tokens[] = {
+        "\033", "[", ";", "m", "0", "1", "3", "4", "9", "\n", "\r", "x",
+        "\033[0m", "\033[1;31m", "\033[01;02;39m", "\033[40m", "\033[1;40m",
+        "\033[123m", "\033[m", "\033[K", "\033[?25l", "\033]8;;url\007",
+        "\033]0;title\033\\", "\033Pdata\033\\", "\033(B", "\033\\", "\xc3\xa4",
+    };
+    const size_t len = fuzz_rand (state) % max;
+    size_t size = 0;
+
+    while (size < len)
+      {
+        const char *token = tokens[fuzz_rand (state) % COUNT_OF (tokens, const char *)];
+        const size_t token_len = strlen (token);
+        if (size + token_len > max)
+          break;
+        memcpy (data + size, token, token_len);
+        size += token_len;
+      }
+    return size;
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long iterations = 10000, state = 1, i;
+    int opt;
+
+    program_name = argv[0];
+
+    while ((opt = getopt (argc, argv, "n:s:")) != -1)
+      {
+        switch (opt)
+          {
+            case 'n':
+              iterations = strtoul (optarg, NULL, 10);
+              break;
+            case 's':
+              state = strtoul (optarg, NULL, 10);
+              break;
+            default:
+              fprintf (stderr, "Usage: %s [-n ITERATIONS] [-s SEED] [FILE...]\n", program_name);
+              exit (EXIT_FAILURE);
+          }
+      }
+    if (state == 0)
+      state = 1;
+
+    fuzz_init ();
+
+    /* replay inputs (corpus, AFL) */
+    if (optind < argc)
+      {
+        int arg;
+        for (arg = optind; arg < argc; arg++)
+          {
+            FILE *file = open_file (argv[arg], "rb");
+            unsigned char *data = NULL;
+            size_t size = 0, bytes_read;
+            unsigned char buf[BUF_SIZE];
+            while ((bytes_read = fread (buf, 1, sizeof (buf), file)) > 0)
+              {
+                data = xrealloc (data, size + bytes_read);
+                memcpy (data + size, buf, bytes_read);
+                size += bytes_read;
+              }
+            fclose (file);
+            fuzz_one (data, size);
+            free (data);
+          }
+      }
+    /* random inputs */
+    else
+      {
+        unsigned char *data = xmalloc (4 * BUF_SIZE);
+        for (i = 0; i < iterations; i++)
+          fuzz_one (data, fuzz_generate (data, 4 * BUF_SIZE, &state));
+        free (data);
+      }
+
+    free (fuzz_output.data);
+
+    exit (EXIT_SUCCESS);
+}
+#endif /* !FUZZ_LIBFUZZER */
+#endif /* FUZZ */
+
+#ifdef BENCH
+/* Microbenchmarks of internal functions on fixed inputs, so that a
+   regression can be attributed to a single stage instead of hiding in
+   the end-to-end throughput.
+
+   make bench; ./bench [-n REPETITIONS] [-w WARMUP] [NAME...]
+
+   Each repetition runs a batch of operations over about 1 MiB of input
+   (or BENCH_OPS operations for functions without input).  Median,
+   minimum and maximum over the repetitions and the median absolute
+   deviation are reported.  Cycles are read from the time stamp counter
+   where available, hence they are reference cycles.  Output of the
+   print functions is discarded.  */
+
+#define BENCH_BATCH_BYTES (1024 * 1024)
+#define BENCH_OPS 100000
+#define BENCH_LINES 64
+
+static const char *const bench_text =
+  "The quick brown fox jumps over the lazy dog; pack my box with five dozen liquor jugs 0123456789";
+static const char *const bench_seqs[] = {
+    "\033[0m", "\033[1;31m", "\033[01;02;39m", "\033[38;5;208m", "\033[48;2;10;20;30m",
+    "\033[K", "\033[?25l", "\033]8;;url\007", "\033]0;title\033\\", "\033(B",
+};
+
+static struct {
+    char *line;  /* bench_text interleaved with bench_seqs */
+    char *chunk; /* BENCH_LINES lines, restored before each run */
+    char *chunk_orig;
+    size_t chunk_len;
+    const struct color *colors[2];
+} bench_input;
+
+static volatile unsigned long bench_sink;
+
+static size_t
+bench_gather_esc_offsets (void)
+{
+    size_t bytes = 0;
+    unsigned int i;
+    for (i = 0; i < COUNT_OF (bench_seqs, const char *); i++)
+      {
+        const char *start = NULL, *end = NULL;
+        bench_sink += gather_esc_offsets (bench_seqs[i], &start, &end);
+        bytes += strlen (bench_seqs[i]);
+      }
+    return bytes;
+}
+
+static size_t
+bench_print_clean (void)
+{
+    print_clean (bench_input.line);
+    return strlen (bench_input.line);
+}
+
+static size_t
+bench_print_clean_fast (void)
+{
+    print_clean_fast (bench_input.line);
+    return strlen (bench_input.line);
+}
+
+static size_t
+bench_print_line (void)
+{
+    print_line ("1;", bench_input.colors, bench_text, LF, true);
+    return strlen (bench_text);
+}
+
+static size_t
+bench_get_rainbow_index (void)
+{
+    const unsigned int max = tables[FOREGROUND].count - 2;
+    unsigned int index;
+    for (index = 1; index <= max; index++)
+      bench_sink += get_rainbow_index (bench_input.colors, BACKGROUND, index, max);
+    return 0;
+}
+
+static size_t
+bench_print_lines (char *(*func) (const char *, const struct color **, const char *, char *, const char *, bool *))
+{
+    bool end = false;
+    memcpy (bench_input.chunk, bench_input.chunk_orig, bench_input.chunk_len + 1);
+    func ("", bench_input.colors, "bench", bench_input.chunk, bench_input.chunk + bench_input.chunk_len, &end);
+    return bench_input.chunk_len;
+}
+
+static size_t
+bench_print_lines_plain (void)
+{
+    return bench_print_lines (print_lines_plain);
+}
+
+static size_t
+bench_print_lines_clean (void)
+{
+    return bench_print_lines (print_lines_clean);
+}
+
+static size_t
+bench_print_lines_color (void)
+{
+    line_seqs->color_prefix_len = sprintf (line_seqs->color_prefix, "\033[31m");
+    return bench_print_lines (print_lines_color);
+}
+
+static size_t
+bench_print_lines_gather (void)
+{
+    size_t len;
+    line_seqs->color_prefix_len = sprintf (line_seqs->color_prefix, "\033[31m");
+    len = bench_print_lines (print_lines_gather);
+    gather_flush ();
+    return len;
+}
+
+static const struct {
+    const char *name;
+    size_t (*op) (void);
+    bool clean;
+    bool clean_all;
+} benches[] = {
+    { "gather_esc_offsets",           bench_gather_esc_offsets, true,  false },
+    { "gather_esc_offsets/clean-all", bench_gather_esc_offsets, false, true  },
+    { "print_clean",                  bench_print_clean,        true,  false },
+    { "print_clean_fast",             bench_print_clean_fast,   true,  false },
+    { "print_line",                   bench_print_line,         false, false },
+    { "get_rainbow_index",            bench_get_rainbow_index,  false, false },
+    { "print_lines/plain",            bench_print_lines_plain,  false, false },
+    { "print_lines/clean",            bench_print_lines_clean,  true,  false },
+    { "print_lines/color",            bench_print_lines_color,  false, false },
+    { "print_lines/gather",           bench_print_lines_gather, false, false },
+};
+
+static double
+bench_nsecs (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+bench_cycles (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+    unsigned int lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return hi * 4294967296.0 + lo;
+#else
+    return 0.0;
+#endif
+}
+
+static int
+bench_cmp (const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+bench_median (double *values, unsigned int count)
+{
+    qsort (values, count, sizeof (double), bench_cmp);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static void
+bench_init (void)
+{
+    const size_t text_len = strlen (bench_text);
+    size_t len = 0, line_len;
+    unsigned int i;
+    char *p;
+
+    /* text fragments in between sequences */
+    for (i = 0; i < COUNT_OF (bench_seqs, const char *); i++)
+      len += strlen (bench_seqs[i]) + text_len / 8;
+    p = bench_input.line = xmalloc (len + 1);
+    for (i = 0; i < COUNT_OF (bench_seqs, const char *); i++)
+      {
+        const size_t seq_len = strlen (bench_seqs[i]);
+        memcpy (p, bench_seqs[i], seq_len);
+        memcpy (p + seq_len, bench_text + i * (text_len / 16), text_len / 8);
+        p += seq_len + text_len / 8;
+      }
+    *p = '\0';
+
+    line_len = strlen (bench_input.line);
+    bench_input.chunk_len = BENCH_LINES * (line_len + 1);
+    bench_input.chunk_orig = xmalloc (bench_input.chunk_len + 1);
+    bench_input.chunk = xmalloc (bench_input.chunk_len + 1);
+    for (i = 0; i < BENCH_LINES; i++)
+      {
+        memcpy (bench_input.chunk_orig + i * (line_len + 1), bench_input.line, line_len);
+        bench_input.chunk_orig[i * (line_len + 1) + line_len] = '\n';
+      }
+    bench_input.chunk_orig[bench_input.chunk_len] = '\0';
+
+    bench_input.colors[FOREGROUND] = &fg_colors[2]; /* red */
+    bench_input.colors[BACKGROUND] = &bg_colors[2]; /* red */
+
+    select_scanner (NULL);
+
+    if (!freopen ("/dev/null", "w", stdout))
+      vfprintf_fail (formats[FMT_GENERIC], "cannot discard standard output");
+    setvbuf (stdout, NULL, _IOFBF, BUF_SIZE);
+    out = stdout;
+    flush_mode = FLUSH_FULL;
+}
+
+static void
+bench_run (unsigned int b, unsigned int reps, unsigned int warmup)
+{
+    double *nsecs = xmalloc (reps * sizeof (double));
+    double *cycles = xmalloc (reps * sizeof (double));
+    double *devs = xmalloc (reps * sizeof (double));
+    double median, mad, cycles_median;
+    unsigned long ops, op;
+    size_t bytes;
+    unsigned int r;
+
+    clean = benches[b].clean;
+    clean_all = benches[b].clean_all;
+    bytes = benches[b].op ();
+    ops = bytes ? BENCH_BATCH_BYTES / bytes + 1 : BENCH_OPS;
+
+    for (r = 0; r < warmup + reps; r++)
+      {
+        const double t1 = bench_nsecs (), c1 = bench_cycles ();
+        double t2, c2;
+        for (op = 0; op < ops; op++)
+          benches[b].op ();
+        c2 = bench_cycles ();
+        t2 = bench_nsecs ();
+        if (r >= warmup)
+          {
+            nsecs[r - warmup] = (t2 - t1) / ops;
+            cycles[r - warmup] = (c2 - c1) / ops;
+          }
+      }
+    fflush (out);
+
+    median = bench_median (nsecs, reps);
+    for (r = 0; r < reps; r++)
+      devs[r] = nsecs[r] > median ? nsecs[r] - median : median - nsecs[r];
+    mad = bench_median (devs, reps);
+    cycles_median = bench_median (cycles, reps);
+
+    fprintf (stderr, "%-28s %10.1f %10.1f %10.1f %6.1f%% %10.1f", benches[b].name,
+             median, nsecs[0], nsecs[reps - 1], median > 0 ? mad / median * 100 : 0.0, cycles_median);
+    if (bytes)
+      fprintf (stderr, " %8.2f %9.1f\n", cycles_median / bytes, bytes / median * 1e3);
+    else
+      fprintf (stderr, " %8s %9s\n", "-", "-");
+
+    free (nsecs);
+    free (cycles);
+    free (devs);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned int reps = 31, warmup = 5, b;
+    int opt;
+
+    program_name = argv[0];
+
+    while ((opt = getopt (argc, argv, "n:w:")) != -1)
+      {
+        switch (opt)
+          {
+            case 'n':
+              reps = strtoul (optarg, NULL, 10);
+              break;
+            case 'w':
+              warmup = strtoul (optarg, NULL, 10);
+              break;
+            default:
+              fprintf (stderr, "Usage: %s [-n REPETITIONS] [-w WARMUP] [NAME...]\n", program_name);
+              exit (EXIT_FAILURE);
+          }
+      }
+    if (reps == 0)
+      reps = 1;
+
+    bench_init ();
+
+    fprintf (stderr, "%s: %u repetitions, %u warmup, %s scanner\n", program_name, reps, warmup, scanner_name);
+    fprintf (stderr, "%-28s %10s %10s %10s %7s %10s %8s %9s\n",
+             "function", "ns/op", "min", "max", "mad", "cycles/op", "cyc/byte", "MB/s");
+    for (b = 0; b < COUNT_OF (benches, benches[0]); b++)
+      {
+        int arg;
+        bool selected = (optind == argc);
+        for (arg = optind; arg < argc && !selected; arg++)
+          selected = !strncmp (benches[b].name, argv[arg], strlen (argv[arg]));
+        if (selected)
+          bench_run (b, reps, warmup);
+      }
+
+    free (bench_input.line);
+    free (bench_input.chunk);
+    free (bench_input.chunk_orig);
+
+    exit (EXIT_SUCCESS);
+}
+#endif /* BENCH */
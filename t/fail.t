@@ -12,7 +12,7 @@ use IPC::Open3 qw(open3);
 use Symbol qw(gensym);
 use Test::More;
 
-my $tests = 31;
+my $tests = 67;
 
 my $run_program_fail = sub
 {
@@ -46,7 +46,38 @@ SKIP: {
         [ '--attr=b0ld,underscore',     'attribute \'b0ld\' is not valid'             ], # handle comma
         [ '--attr=bold,bold',           'has attribute \'bold\' twice or more'        ],
         [ '--exclude-random=random',    'must be provided a plain color'              ],
+        [ '--flush=never',              'must be provided line, auto or full'         ],
+        [ '--rainbow=pixel',            'must be provided line, char or word'         ],
+        [ '--max-fps=0',                'rate \'0\' is not valid'                      ],
+        [ '--max-fps=10,0',             'backlog \'0\' is not valid'                   ],
+        [ '--max-fps=10,x',             'must be provided N or N,LINES'               ],
+        [ '--timestamp= red',           'format \'\' is not valid'                     ],
+        [ '--timestamp --timestamp-color=x red', 'color \'x\' is not valid'          ],
+        [ '--exec=true --lines=1-2 red', '--exec and --lines switch are mutually exclusive' ],
+        [ '--exec=true red blue',       'expected 0-1 arguments with --exec'           ],
+        [ '--exec=true --stderr=y3llow', 'cannot be made of non-alphabetic characters' ],
+        [ '--in-place=copy --clean file', 'must be provided truncate or rename'       ],
+        [ '--in-place red file',        'requires --clean or --clean-all'              ],
+        [ "--in-place --clean $dir",    'not a regular file'                           ],
+        [ "--recursive=$dir red",       'requires --clean or --clean-all'              ],
+        [ "--recursive=$dir --clean",   'requires either --in-place or --output'       ],
+        [ "--recursive=$file --clean --in-place", 'not a directory'                    ],
+        [ "--recursive=$dir --clean -o $dir/out", 'output directory is within input directory' ],
         [ '--clean --clean-all',        'mutually exclusive'                          ],
+        [ '--clean-all=sgr:csi',        'must have strings separated by ,'            ],
+        [ '--clean-all=',               'must be provided a string'                   ],
+        [ '--clean-all=sgr,',           'must be provided a string'                   ],
+        [ '--clean-all=sgr,foo',        'sequence type \'foo\' is not valid'           ],
+        [ '--clean-all --normalize',    'mutually exclusive'                          ],
+        [ '--clean --field-colors=1=red', 'mutually exclusive'                        ],
+        [ '--field-colors=0=red',       'field \'0\' is not valid'                     ],
+        [ '--field-colors=1=red,1=blue', 'has field \'1\' twice or more'              ],
+        [ '--field-colors=1=red --delimiter=ab', 'must be provided TAB, SPACE or a single character' ],
+        [ '--lines=0-3',                'start \'0\' is not valid'                     ],
+        [ '--lines=5-3',                'end \'3\' is not valid'                       ],
+        [ '--lines=-',                  'must be provided START-END, START- or -N'    ],
+        [ '--tee=file --lines=1-2 --pass-through red', 'mutually exclusive'        ],
+        [ '--clean --scanner=mmx',      'variant `mmx\' not available'                ],
         [ '--clean file1 file2',        'more than one file'                          ],
         [ '--clean-all file1 file2',    'more than one file'                          ],
         [ '- file',                     'hyphen cannot be used as color string'       ],
@@ -54,6 +85,7 @@ SKIP: {
         [ "$file file",                 'cannot be used as color string'              ],
         [ "$file",                      'must be preceded by color string'            ],
         [ "$dir",                       'is not a valid file type'                    ],
+        [ "-o $file red $file",         'input file is output file'                   ],
         [ '/black',                     'foreground color missing'                    ],
         [ 'white/',                     'background color missing'                    ],
         [ 'white/black/yellow',         'one color pair allowed only'                 ],
@@ -66,6 +98,9 @@ SKIP: {
         [ 'none/random',                'cannot be combined with'                     ],
         [ 'default/random',             'cannot be combined with'                     ],
         [ '--rainbow-fg --rainbow-bg',  'mutually exclusive'                          ],
+        [ 'red --hash-key=0',           'field \'0\' is not valid'                     ],
+        [ 'red --hash-key=(',           'regex \'\(\''                                  ],
+        [ 'red --rainbow-fg --hash-key=1', 'mutually exclusive'                       ],
         [ 'green --rainbow-bg',         'background color required with'              ],
         [ 'white/none --rainbow-fg',    'cannot be used with --rainbow-fg'            ],
         [ 'white/default --rainbow-bg', 'cannot be used with --rainbow-bg'            ],
@@ -78,3 +113,15 @@ SKIP: {
 
     unlink $program;
 }
+
+SKIP: {
+    my $program = tmpnam();
+    skip 'compiling failed (decompress)', 1 unless system("$compiler -DTEST -DHAVE_ZLIB -o $program $source -lz -pthread 2>/dev/null") == 0;
+    skip 'gzip not found', 1 unless system('gzip --version >/dev/null 2>&1') == 0;
+
+    my $file = tmpnam();
+    system("seq 1 10000 | gzip -c | head -c 12 >$file.gz");
+    ok($run_program_fail->($program, "--clean $file.gz", 'unexpected end of compressed data'), 'truncated gzip input');
+
+    unlink $program, "$file.gz";
+}
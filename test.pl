@@ -8,12 +8,12 @@ use constant false => 0;
 
 use Colorize::Common qw(:defaults $compiler_flags %BUF_SIZE $valgrind_command $write_to_tmpfile);
 use File::Find;
-use File::Temp qw(tmpnam);
+use File::Temp qw(tempdir tmpnam);
 use Getopt::Long qw(:config no_auto_abbrev no_ignore_case);
 use Test::Harness qw(runtests);
 use Test::More;
 
-my $tests = 38;
+my $tests = 116;
 
 my $valgrind_cmd = '';
 {
@@ -101,7 +101,7 @@ SKIP: {
 
         {
             my $ok = true;
-            foreach my $option (qw(--attr=bold --exclude-random=black --omit-color-empty --rainbow-fg --rainbow-bg)) {
+            foreach my $option (qw(--attr=bold --exclude-random=black --minimal-escapes --omit-color-empty --rainbow-fg --rainbow-bg)) {
                 $ok &= qx($valgrind_cmd$program $option $switch $infile1 2>&1 >/dev/null) =~ /switch has no meaning with/;
             }
             ok($ok, "$type strict options");
@@ -112,6 +112,201 @@ SKIP: {
 
     is(qx(printf %s "\e[4munderline\e[24m" | $valgrind_cmd$program --clean-all), 'underline', 'clean-all color sequences');
 
+    {
+        my $sequences = "a\e[Kb\e[2;3Hc\e[?25ld\e]8;;http://example.com\ae\e]0;title\e\\f\ePq\e\\g\e(Bh\e[1;31mi\e[0m";
+
+        is(qx(printf %s '$sequences' | $valgrind_cmd$program --clean-all), 'abcdefghi', 'clean-all sequences');
+        is(qx(printf %s '$sequences' | $valgrind_cmd$program --clean-all=sgr,csi,osc,dcs,esc), 'abcdefghi', 'clean-all sequences (all types)');
+        is(qx(printf %s "a\e[Kb\e[31mc" | $valgrind_cmd$program --clean-all=sgr), "a\e[Kbc", 'clean-all sequences (sgr)');
+        is(qx(printf %s "a\e[Kb\e[31mc" | $valgrind_cmd$program --clean-all=csi), "ab\e[31mc", 'clean-all sequences (csi)');
+        is(qx(printf %s "a\e]8;;url\ab\e]8;;\e\\\\c" | $valgrind_cmd$program --clean-all=osc), 'abc', 'clean-all sequences (osc)');
+    }
+
+    {
+        my @set = (
+            [ "\e[31mfoo\e[31m\e[31mbar\e[0m",                  "\e[31mfoobar\e[0m",                      'redundant sequences'  ],
+            [ "\e[1m\e[31mfoo\e[0m",                             "\e[1;31mfoo\e[0m",                       'adjacent sequences'   ],
+            [ "\e[0mfoo\e[1;31m\e[0m",                           "foo",                                    'sequences unchanging' ],
+            [ "\e[1;2;31mfoo\e[22;2mbar\e[39m",                  "\e[1;2;31mfoo\e[22;2mbar\e[39m",          'attributes off'       ],
+            [ "\e[38;5;100mfoo\e[38;5;100mbar\e[38;2;1;2;3mbaz", "\e[38;5;100mfoobar\e[38;2;1;2;3mbaz",     'extended colors'      ],
+            [ "\e[53mfoo\e[0;31mbar\e[0m",                       "\e[53mfoo\e[0;31mbar\e[0m",               'unknown parameters'   ],
+            [ "\e[31mfoo\e[0m\n\e[31mbar\e[0m",                   "\e[31mfoo\e[0m\n\e[31mbar\e[0m",           'line endings'         ],
+            [ "a\e[31;53mb\e[0m",                               "a\e[31;53mb\e[0m",                       'unknown with known'   ],
+            [ "\e[1m\e[31;53mb\e[0m",                           "\e[1m\e[31;53mb\e[0m",                   'unknown after pending' ],
+        );
+        foreach my $set (@set) {
+            is(qx(printf %s "$set->[0]" | $valgrind_cmd$program --normalize), $set->[1], "normalize $set->[2]");
+        }
+    }
+
+    {
+        my @set = (
+            [ "a\tbb\t\tc",  '',                    "\e[31ma\e[0m\t\e[37mbb\e[0m\t\t\e[1;36mc\e[0m", 'tab'   ],
+            [ '  a  b c',  '--delimiter=SPACE',   "  \e[31ma\e[0m  \e[37mb\e[0m \e[1;36mc\e[0m",   'space' ],
+            [ 'a,,b',      '--delimiter=,',       "\e[31ma\e[0m,,\e[1;36mb\e[0m",               'char'  ],
+        );
+        foreach my $set (@set) {
+            is(qx(printf '$set->[0]' | $valgrind_cmd$program --field-colors=1=red,2=white,*=Cyan $set->[1]), $set->[2], "field colors ($set->[3])");
+        }
+        is(qx(printf '%s' "a\tb\tc\td" | $valgrind_cmd$program --field-colors=1=red,3=Cyan,*=white),
+          "\e[31ma\e[0m\t\e[37mb\e[0m\t\e[1;36mc\e[0m\t\e[37md\e[0m", 'field colors (gap)');
+    }
+
+    is(qx(printf 'x id=abc\\nfoo\\nid=abc y\\nid=def\\n' | $valgrind_cmd$program --hash-key='id=([a-z]+)' white),
+      "\e[33mx id=abc\e[0m\n\e[37mfoo\e[0m\n\e[33mid=abc y\e[0m\n\e[34mid=def\e[0m\n", 'hash key (regex)');
+    is(qx(printf 'a b\\nc  b\\nd e\\n' | $valgrind_cmd$program --hash-key=2 --delimiter=SPACE none),
+      "\e[35ma b\e[0m\n\e[35mc  b\e[0m\n\e[30md e\e[0m\n", 'hash key (field)');
+    {
+        my $keys = join '\\n', 1..100;
+        my $output = qx(printf '$keys' | $valgrind_cmd$program --hash-key=1 --exclude-random=red green/black);
+        ok($output !~ /\e\[3[01]m/, 'hash key exclusions');
+    }
+
+    {
+        my $infile = $write_to_tmpfile->(join '', map "$_\n", 1..1000);
+        is(qx($valgrind_cmd$program --lines=5-6 red $infile), "\e[31m5\e[0m\n\e[31m6\e[0m\n", 'lines range (file)');
+        is(qx(cat $infile | $valgrind_cmd$program --lines=-2 --clean), "1\n2\n", 'lines range (stdin)');
+        my $expected = join '', (map "$_\n", 1..997), (map "\e[31m$_\e[0m\n", 998..999), "1000\n";
+        is(qx($valgrind_cmd$program --lines=998-999 --pass-through red $infile), $expected, 'lines range pass-through (file)');
+        is(qx(cat $infile | $valgrind_cmd$program --lines=998-999 --pass-through red), $expected, 'lines range pass-through (stdin)');
+        unlink $infile;
+    }
+
+    {
+        my $outfile = tmpnam();
+        my $expected = qx($program red $infile1);
+        system("$valgrind_cmd$program -o $outfile red $infile1");
+        is(do { local $/; open(my $fh, '<', $outfile) or die "Cannot open $outfile: $!\n"; <$fh> }, $expected, 'output to file');
+        system("$valgrind_cmd$program --output=$outfile --direct --preallocate --fsync red $infile1 2>/dev/null");
+        is(do { local $/; open(my $fh, '<', $outfile) or die "Cannot open $outfile: $!\n"; <$fh> }, $expected, 'output to file (direct, preallocate, fsync)');
+        unlink $outfile;
+    }
+
+    {
+        my $html = sub { "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"UTF-8\">\n<title>colorize</title>\n</head>\n<body>\n<pre>\n$_[0]</pre>\n</body>\n</html>\n" };
+        is(qx(printf 'a<&>\\033[1;31mb\\033[0m\\033[Kc\\033[32m\\033[38;5;21md\\n' | $valgrind_cmd$program --html none),
+          $html->(qq(a&lt;&amp;&gt;<span style="font-weight:bold;color:#aa0000;">b</span>c<span style="color:#0000ff;">d\n</span>)), 'html (sequences)');
+        is(qx(printf 'a\\nb\\n' | $valgrind_cmd$program --html red/white),
+          $html->(qq(<span style="color:#aa0000;background-color:#aaaaaa;">a</span>\n<span style="color:#aa0000;background-color:#aaaaaa;">b</span>\n)), 'html (coloring)');
+    }
+
+    {
+        my $teefile = tmpnam();
+        is(qx(printf 'a\\033[31mb\\033[0m\\n' | $valgrind_cmd$program --tee=$teefile green), "\e[32ma\e[31mb\e[0m\e[0m\n", 'tee (stdout)');
+        is(do { local $/; open(my $fh, '<', $teefile) or die "Cannot open $teefile: $!\n"; <$fh> }, "ab\n", 'tee (file)');
+        qx(printf 'a\\033[38;5;100mb\\033]8;;http://example.com/\\033\\\\c\\n' | $valgrind_cmd$program --tee=$teefile red);
+        is(do { local $/; open(my $fh, '<', $teefile) or die "Cannot open $teefile: $!\n"; <$fh> }, "abc\n", 'tee (file, all sequences)');
+        unlink $teefile;
+    }
+
+    {
+        my $tracefile = tmpnam();
+        is(qx($valgrind_cmd$program --trace-latency=$tracefile red $infile1), qx($program red $infile1), 'trace latency (output)');
+        like(do { local $/; open(my $fh, '<', $tracefile) or die "Cannot open $tracefile: $!\n"; <$fh> }, qr/^input to output\s+[1-9]\d*\s.*^write wait\s+[1-9]\d*\s/ms, 'trace latency (report)');
+        unlink $tracefile;
+    }
+
+    is(qx(seq 1 1000 | $valgrind_cmd$program --max-fps=1,10 red), qx(seq 1 1000 | $program red), 'max fps (lossless without terminal)');
+
+    SKIP: {
+        skip 'script(1) with pty support not available', 2 unless system("script -qec true /dev/null </dev/null >/dev/null 2>&1") == 0;
+
+        my $seqfile = $write_to_tmpfile->(join '', map "$_\n", 1..1000);
+
+        # Lines shown plus lines skipped have to add up to the input in
+        # order, while the last frame holds the lines kept by frame_trim().
+        my $frames = sub
+        {
+            my ($rows) = @_;
+            my $output = qx(script -qec "stty rows $rows; $valgrind_cmd$program --max-fps=1,10 red $seqfile 2>/dev/null" /dev/null </dev/null);
+            $output =~ tr/\r//d;
+            $output =~ s/\e\[[0-9;]*m//g;
+            my ($line, $kept, $skipped, $ordered) = (0, 0, 0, true);
+            foreach (split /\n/, $output) {
+                if (/^\[(\d+) lines skipped\]$/) {
+                    $line += $1;
+                    $kept = 0;
+                    $skipped++;
+                }
+                else {
+                    $ordered &&= $_ eq ++$line;
+                    $kept++;
+                }
+            }
+            return [ $line, $kept, $skipped > 0, $ordered ];
+        };
+
+        is_deeply($frames->(24), [ 1000, 10, true, true ], 'max fps (terminal, backlog)');
+        is_deeply($frames->(5),  [ 1000,  4, true, true ], 'max fps (terminal, screen rows)');
+    }
+
+    is(qx(printf 'a\\nb' | $valgrind_cmd$program --timestamp='<%%>' red), "\e[2m<%>\e[0m \e[31ma\e[0m\n\e[2m<%>\e[0m \e[31mb\e[0m", 'timestamp');
+    is(qx(printf 'a\\n' | $valgrind_cmd$program --timestamp='<%%>' --timestamp-color=Yellow red), "\e[1;33m<%>\e[0m \e[31ma\e[0m\n", 'timestamp (color)');
+    is(qx(printf 'a\\nb\\n' | $valgrind_cmd$program --timestamp='<%%>' --minimal-escapes red), "\e[2m<%>\e[0m \e[31ma\n\e[2m<%>\e[0m \e[31mb\n\e[0m", 'timestamp (minimal-escapes)');
+    like(qx(printf 'a\\n' | $valgrind_cmd$program --timestamp='%.s' --clean), qr/^\d+\.\d{6} a\n\z/, 'timestamp (fraction)');
+
+    is(qx($valgrind_cmd$program --exec='echo a; sleep 0.1; echo b >&2; sleep 0.1; echo c' --stdout=green --stderr=Red),
+      "\e[32ma\e[0m\n\e[1;31mb\e[0m\n\e[32mc\e[0m\n", 'exec (stdout and stderr)');
+    system("$valgrind_cmd$program --exec='exit 3' red");
+    is($? >> 8, 3, 'exec (exit status)');
+    is(qx($valgrind_cmd$program --exec='head -c 5000 /dev/zero | tr "\\0" a; head -c 100000 /dev/zero | tr "\\0" b >&2; echo >&2; printf "\\nc\\n"' --stdout=green --stderr=red),
+      "\e[32m" . 'a' x 5000 . "\e[0m\n\e[31m" . 'b' x 100000 . "\e[0m\n\e[32mc\e[0m\n", 'exec (stderr filled amid long line)');
+    is(qx($valgrind_cmd$program --exec='echo ab; sleep 0.1; echo cd >&2; sleep 0.1; echo ef; sleep 0.1; echo gh >&2' --stdout=red --stderr=green --rainbow=char),
+      "\e[31ma\e[32mb\e[0m\n\e[32mc\e[33md\e[0m\n\e[33me\e[34mf\e[0m\n\e[34mg\e[35mh\e[0m\n", 'exec (rainbow per stream)');
+
+    {
+        my @lines = map { ('g' x $_) . ($_ % 2 ? "\r\n" : "\n") } (0, 1, 255, 256, 300, 5000, 20);
+        my $infile = $write_to_tmpfile->(join '', @lines);
+        is(qx($valgrind_cmd$program Green/blue $infile), join('', map { /^(g*)(\r?\n)$/; "\e[44m\e[1;32m$1\e[0m$2" } @lines), 'gathered output (long lines)');
+    }
+
+    foreach my $mode (qw(truncate rename)) {
+        my @files = map { $write_to_tmpfile->($_) } ("a\e[31mb\e[0m\r\n\e]0;t\a\e[1mc\e[", "\e[0m" x 1000, "a\e[1;32mb\e[0m\n" x 200_000 . "c\e[0m");
+        chmod 0640, $files[0];
+        system("$valgrind_cmd$program --clean-all --in-place=$mode @files");
+        is_deeply([ (map { do { local $/; open(my $fh, '<', $_) or die "Cannot open $_: $!\n"; <$fh> } } @files[0,2]), -s $files[1], (stat $files[0])[2] & 07777 ],
+          [ "ab\r\nc\e[", "ab\n" x 200_000 . 'c', 0, 0640 ], "in-place ($mode)");
+    }
+
+    {
+        my $dir = tempdir(CLEANUP => true);
+        my %files = ("$dir/in/a" => "a\e[31mb\e[0m\n", "$dir/in/b/c" => "a\e[1;32mb\e[0m\n" x 400_000 . "c\e[0m");
+        mkdir "$dir/in"; mkdir "$dir/in/b";
+        my $write = sub {
+            foreach my $file (keys %files) {
+                open(my $fh, '>', $file) or die "Cannot open $file: $!\n";
+                print {$fh} $files{$file};
+                close($fh);
+            }
+        };
+        my $read = sub { map { do { local $/; open(my $fh, '<', $_) or die "Cannot open $_: $!\n"; <$fh> } } @_ };
+        my @expected = ("ab\n", "ab\n" x 400_000 . 'c');
+        $write->();
+        system("$valgrind_cmd$program --clean --recursive=$dir/in --output=$dir/out");
+        is_deeply([ $read->("$dir/out/a", "$dir/out/b/c") ], \@expected, 'recursive (output)');
+        foreach my $mode (qw(truncate rename)) {
+            $write->();
+            system("$valgrind_cmd$program --clean --recursive=$dir/in --in-place=$mode");
+            is_deeply([ $read->("$dir/in/a", "$dir/in/b/c") ], \@expected, "recursive (in-place $mode)");
+        }
+        symlink("$dir/missing", "$dir/in/b/dangling") or die "Cannot symlink: $!\n";
+        my $errfile = tmpnam();
+        system("$valgrind_cmd$program --clean --recursive=$dir/in --output=$dir/out2 2>$errfile");
+        my $status = $? >> 8;
+        my ($err) = $read->($errfile);
+        is_deeply([ $status, $read->("$dir/out2/a", "$dir/out2/b/c"), $err =~ m{/in/b/dangling: No such file or directory$}m ? true : false ],
+          [ 1, @expected, true ], 'recursive (entry failing)');
+        unlink $errfile;
+    }
+
+    {
+        my $infile = $write_to_tmpfile->(join '', map { "\e[1;3" . ($_ % 8) . 'm' . ('x' x $_) . "\e[0m\r\n" } 0..100);
+        my $expected = join '', map { ('x' x $_) . "\r\n" } 0..100;
+        my @scanners = grep { system("$program --clean --scanner=$_ </dev/null 2>/dev/null") == 0 } qw(scalar sse2 avx2 avx512);
+        is_deeply([ map { scalar qx($valgrind_cmd$program --clean --scanner=$_ $infile) } @scanners ], [ ($expected) x @scanners ], 'scanner variants');
+        unlink $infile;
+    }
+
     my $check_clean_buf = sub
     {
         my ($program_buf, $type) = @_;
@@ -137,18 +332,45 @@ SKIP: {
 
     SKIP: {
         my $program_buf = tmpnam();
-        skip 'compiling failed (short buffer)', 2 unless system("$compiler -DTEST -DBUF_SIZE=$BUF_SIZE{short} -o $program_buf $source") == 0;
+        skip 'compiling failed (short buffer)', 8 unless system("$compiler -DTEST -DBUF_SIZE=$BUF_SIZE{short} -o $program_buf $source") == 0;
 
         my $short_text = 'foo bar baz' x 2;
 
+        is(qx(printf '%s\n%s' "$short_text" "foo" | $valgrind_cmd$program_buf blue),
+          "\e[34mfoo bar bazfoo bar baz\e[0m\n\e[34mfoo\e[0m",
+          "partial line (BUF_SIZE=$BUF_SIZE{short})");
+
+        {
+            my $teefile = tmpnam();
+            qx(printf 'a\\033]8;;http://example.com/\\033\\\\b\\n' | $valgrind_cmd$program_buf --tee=$teefile none);
+            is(do { local $/; open(my $fh, '<', $teefile) or die "Cannot open $teefile: $!\n"; <$fh> }, "ab\n", "tee split sequence (BUF_SIZE=$BUF_SIZE{short})");
+            unlink $teefile;
+        }
+
+        is(qx(printf 'ab\\033]0;x y z\\007cd\\n' | $valgrind_cmd$program_buf red --rainbow=char),
+          "\e[31ma\e[32mb\e]0;x y z\a\e[33mc\e[34md\e[0m\n",
+          "rainbow split sequence (BUF_SIZE=$BUF_SIZE{short})");
+
+        is(qx(printf '%s\n%s' "0123456789" "ab" | $valgrind_cmd$program_buf blue),
+          "\e[34m0123456789\e[0m\n\e[34mab\e[0m",
+          "partial line ending at buffer end (BUF_SIZE=$BUF_SIZE{short})");
+
         is(qx(printf %s "$short_text" | $valgrind_cmd$program_buf blue --rainbow-fg),
-          "\e[34mfoo bar ba\e[0m\e[34mzfoo bar b\e[0m\e[34maz\e[0m",
+          "\e[34mfoo bar bazfoo bar baz\e[0m",
           "partial line (BUF_SIZE=$BUF_SIZE{short}, rainbow-fg)");
 
         is(qx(printf %s "$short_text" | $valgrind_cmd$program_buf blue/black --rainbow-bg),
-          "\e[40m\e[34mfoo bar ba\e[0m\e[40m\e[34mzfoo bar b\e[0m\e[40m\e[34maz\e[0m",
+          "\e[40m\e[34mfoo bar bazfoo bar baz\e[0m",
           "partial line (BUF_SIZE=$BUF_SIZE{short}, rainbow-bg)");
 
+        is(qx(printf '%s\t%s' "$short_text" "foo" | $valgrind_cmd$program_buf --field-colors=1=red,2=blue),
+          "\e[31mfoo bar bazfoo bar baz\e[0m\t\e[34mfoo\e[0m",
+          "partial line (BUF_SIZE=$BUF_SIZE{short}, field-colors)");
+
+        is(qx(printf '%s\n%s\n%s' "$short_text" "$short_text" "foo" | $valgrind_cmd$program_buf --lines=2-2 --pass-through blue),
+          "$short_text\n\e[34m$short_text\e[0m\nfoo",
+          "partial line (BUF_SIZE=$BUF_SIZE{short}, lines)");
+
         unlink $program_buf;
     }
 
@@ -168,6 +390,21 @@ SKIP: {
 
     is(qx(printf %s "hello\nworld\r\n" | $valgrind_cmd$program none/none), "hello\nworld\r\n", 'stream mode');
 
+    foreach my $mode (qw(line auto full)) {
+        is_deeply([split /\n/, qx(cat $infile1 | $valgrind_cmd$program --flush=$mode none/none)], [split /\n/, $text], "switch flush ($mode)");
+    }
+
+    {
+        my $start = time;
+        open(my $fh, '-|', qq((printf '%s\n' "foo"; sleep 2; printf '%s\n' "bar") | $program --flush=auto none/none)) or die "Cannot spawn $program: $!\n";
+        my $line = <$fh>;
+        my $elapsed = time - $start;
+        close($fh);
+        ok($line eq "foo\n" && $elapsed < 2, 'switch flush (auto, idle input)');
+    }
+
+    is(qx((printf %s "foo"; sleep 0.1; printf '%s\n' "bar") | $valgrind_cmd$program --flush=auto red), "\e[31mfoobar\e[0m\n", 'switch flush (auto, line split across reads)');
+
     is(system(qq(printf '%s\n' "hello world" | $valgrind_cmd$program random --exclude-random=black >/dev/null)), 0, 'switch exclude-random');
 
     {
@@ -197,11 +434,86 @@ SKIP: {
                   'switch rainbow-bg (reset)');
     }
 
+    is(qx(printf 'h\303\251 \033[1mx\n' | $valgrind_cmd$program white --rainbow=char),
+      "\e[37mh\e[30m\303\251 \e[1m\e[31mx\e[0m\n", 'switch rainbow (char)');
+    is(qx(printf ' ab cd  ef\n' | $valgrind_cmd$program black/black --rainbow=word --rainbow-bg),
+      "\e[30m\e[41m \e[42mab \e[43mcd  \e[44mef\e[0m\n", 'switch rainbow (word)');
+    is(qx(printf 'a\\033]0;ti tle\\007b c\\n' | $valgrind_cmd$program red --rainbow=word),
+      "\e[31ma\e]0;ti tle\ab \e[32mc\e[0m\n", 'switch rainbow (word, sequence)');
+
+    {
+        my $infile = $write_to_tmpfile->("foo\nbar\n\nbaz");
+
+        is(qx($valgrind_cmd$program red --minimal-escapes $infile),
+           "\e[31mfoo\nbar\n\nbaz\e[0m",
+           'switch minimal-escapes');
+
+        is(qx($valgrind_cmd$program yellow --minimal-escapes --omit-color-empty $infile),
+           "\e[33mfoo\nbar\n\e[0m\n\e[33mbaz\e[0m",
+           'switch minimal-escapes (omit-color-empty)');
+
+        is(qx($valgrind_cmd$program white/black --minimal-escapes --rainbow-fg $infile),
+           "\e[40m\e[37mfoo\e[49m\n\e[40m\e[31mbar\e[49m\n\e[40m\e[32m\e[49m\n\e[40m\e[33mbaz\e[0m",
+           'switch minimal-escapes (rainbow-fg)');
+
+        is(qx($valgrind_cmd$program white/blue --minimal-escapes $infile),
+           "\e[44m\e[37mfoo\e[49m\n\e[44mbar\e[49m\n\e[44m\e[49m\n\e[44mbaz\e[0m",
+           'switch minimal-escapes (background)');
+    }
+
     SKIP: {
         skip 'valgrind not found', 1 unless system('which valgrind >/dev/null 2>&1') == 0;
         like(qx(valgrind $program none/none $infile1 2>&1 >/dev/null), qr/no leaks are possible/, 'valgrind memleaks');
     }
 
+    SKIP: {
+        my $decompress = tmpnam();
+        skip 'compiling failed (decompress)', 4 unless system("$compiler $compiler_flags -DHAVE_ZLIB -DHAVE_LZMA -o $decompress $source -lz -llzma -pthread 2>/dev/null") == 0;
+
+        my $text = join '', map "$_ \e[31mred\e[0m\n", 1..20000;
+        my $infile = $write_to_tmpfile->($text);
+        (my $cleaned = $text) =~ s/\e\[\d+m//g;
+
+        SKIP: {
+            skip 'gzip not found', 3 unless system('gzip --version >/dev/null 2>&1') == 0;
+            is(qx(cat $infile $infile | gzip -c >$infile.gz; gzip -c $infile >>$infile.gz; $valgrind_cmd$decompress --clean $infile.gz), $cleaned x 3, 'decompress gzip (concatenated)');
+            is_deeply([ qx(head -c 1000 $infile.gz >$infile.trunc.gz; $valgrind_cmd$decompress none/none $infile.trunc.gz 2>$infile.err) . '', $? >> 8, do { local $/; open(my $fh, '<', "$infile.err") or die "Cannot open $infile.err: $!\n"; <$fh> } ],
+              [ scalar qx(gzip -dc $infile.trunc.gz 2>/dev/null), 1, "$decompress: $infile.trunc.gz: unexpected end of compressed data\n" ], 'decompress gzip (truncated)');
+            is_deeply([ qx(gzip -c $infile >$infile.pad.gz; head -c 4096 /dev/zero >>$infile.pad.gz; $valgrind_cmd$decompress --clean $infile.pad.gz 2>$infile.err) . '', do { local $/; open(my $fh, '<', "$infile.err") or die "Cannot open $infile.err: $!\n"; <$fh> } ],
+              [ $cleaned, "$decompress: $infile.pad.gz: trailing data after compressed data ignored\n" ], 'decompress gzip (trailing data)');
+            unlink "$infile.gz", "$infile.trunc.gz", "$infile.pad.gz", "$infile.err";
+        }
+        SKIP: {
+            skip 'xz not found', 1 unless system('xz --version >/dev/null 2>&1') == 0;
+            is(qx(xz -c $infile >$infile.xz; $valgrind_cmd$decompress --clean <$infile.xz), $cleaned, 'decompress xz');
+            unlink "$infile.xz";
+        }
+
+        unlink $infile;
+        unlink $decompress;
+    }
+
+    SKIP: {
+        my $usdt = tmpnam();
+        skip 'compiling failed (usdt)', 1 unless system("$compiler $compiler_flags -DHAVE_SYS_SDT_H -o $usdt $source -pthread 2>/dev/null") == 0;
+        skip 'readelf not found', 1 unless system('readelf --version >/dev/null 2>&1') == 0;
+        my %probes = map { $_ => true } qx(readelf -n $usdt) =~ /^\s*Name: (\w+)$/gm;
+        is_deeply([ sort keys %probes ], [ qw(alloc chunk__read esc__matched esc__rejected line__emit merge__line) ], 'usdt probes');
+        unlink $usdt;
+    }
+
+    {
+        my $fuzz = tmpnam();
+        is(system("$compiler -DFUZZ -DBUF_SIZE=$BUF_SIZE{normal} -o $fuzz $source && $fuzz -n 500 2>/dev/null"), 0, 'differential fuzzing');
+        unlink $fuzz if -e $fuzz;
+    }
+
+    {
+        my $bench = tmpnam();
+        is(system("$compiler -DBENCH -o $bench $source && $bench -n 1 -w 0 2>/dev/null"), 0, 'microbenchmarks');
+        unlink $bench if -e $bench;
+    }
+
     {
         my $debug = tmpnam();
         is(system("$compiler -DDEBUG -o $debug $source"), 0, 'debugging build');
@@ -0,0 +1 @@
+const char *const version = NULL;